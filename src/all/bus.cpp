@@ -1,45 +1,319 @@
 // (c)2024, Arthur van Hoff, Artfahrt Inc.
 //
 #include "bus.h"
+#include "webserver.h"
 #include <Wire.h>
 
+const char *bus_error_name(int error)
+{
+    switch (error) {
+      case BUS_OK: return "ok";
+      case BUS_ERR_LENGTH: return "length";
+      case BUS_ERR_NACK_ADDR: return "nack_addr";
+      case BUS_ERR_NACK_DATA: return "nack_data";
+      case BUS_ERR_OTHER: return "other";
+      case BUS_ERR_TIMEOUT: return "timeout";
+      case BUS_ERR_SHORT: return "short";
+      case BUS_ERR_CRC: return "crc";
+      case BUS_ERR_SEQ: return "seq";
+      case BUS_ERR_BACKOFF: return "backoff";
+      default: return "?";
+    }
+}
+
+const char *bus_role_name(int role)
+{
+    switch (role) {
+      case BUS_ROLE_CAMERA: return "camera";
+      case BUS_ROLE_FACE_CAMERA: return "face-camera";
+      case BUS_ROLE_ANGLE: return "angle";
+      default: return "unknown";
+    }
+}
+
+// CRC-8, polynomial 0x07
+uint8_t bus_crc8(const unsigned char *buf, int len, uint8_t crc)
+{
+    for (int i = 0 ; i < len ; i++) {
+        crc ^= buf[i];
+        for (int b = 0 ; b < 8 ; b++) {
+            crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : (crc << 1);
+        }
+    }
+    return crc;
+}
+
 //
-// Client
+// Stats
 //
-static BusSlave *client = NULL;
 
-static void handleReceiveCommand(int len) 
+BusStat *BusStats::lookup(uint8_t addr, uint8_t cmd)
 {
-    BusSlave::Buffer cmd(len);
-    Wire.readBytes(cmd.data(), len);
-    client->int_handler(*client, cmd, client->response);
-    if (client->response.size() == 0) {    
-        client->pending.push_back(cmd);
-        client->interval = 0;
+    for (int i = 0 ; i < nstats ; i++) {
+        if (stats[i].addr == addr && stats[i].cmd == cmd) {
+            return &stats[i];
+        }
+    }
+    // the last entry collects everything that does not fit
+    int i = min(nstats, BUS_NSTATS - 1);
+    if (i == nstats) {
+        BusStat &s = stats[nstats++];
+        s.addr = i == BUS_NSTATS - 1 ? 0xFF : addr;
+        s.cmd = i == BUS_NSTATS - 1 ? 0xFF : cmd;
+        s.count = 0;
+        for (int e = 0 ; e < BUS_NERRORS ; e++) {
+            s.errors[e] = 0;
+        }
+        s.bytes_out = 0;
+        s.bytes_in = 0;
+        s.latency.reset();
+        s.handler.reset();
     }
+    return &stats[i];
 }
 
-static void handleRequestData() 
+void BusStats::record(uint8_t addr, uint8_t cmd, unsigned long us, int out, int in, int error)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    BusStat *s = lookup(addr, cmd);
+    s->count += 1;
+    s->errors[error] += error != BUS_OK;
+    s->bytes_out += out;
+    s->bytes_in += in;
+    s->latency.add(us);
+}
+
+void BusStats::record_handler(uint8_t addr, uint8_t cmd, unsigned long us)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    lookup(addr, cmd)->handler.add(us);
+}
+
+void BusStats::reset()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    nstats = 0;
+}
+
+void BusStats::print(HTTP &http)
 {
-    if (client->response.size() > 0) {
-        int n = Wire.write(client->response.data(), client->response.size());
-        if (n != client->response.size()) {
-            dprintf("bus: hdlreqd FAILED 0x%02x len=%d, wrote %d", client->response[0], client->response.size(), n);
+    // copy, so the recording side is not held up by the network
+    std::vector<BusStat> copy;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        copy.assign(stats, stats + nstats);
+    }
+    for (auto &s : copy) {
+        http.printf("0x%02x 0x%02x count=%lu out=%lu in=%lu", s.addr, s.cmd, s.count, s.bytes_out, s.bytes_in);
+        for (int e = 1 ; e < BUS_NERRORS ; e++) {
+            if (s.errors[e] > 0) {
+                http.printf(" %s=%lu", bus_error_name(e), s.errors[e]);
+            }
+        }
+        http.printf(" avg=%luus p50=%luus p99=%luus max=%luus", s.latency.average(), s.latency.percentile(50), s.latency.percentile(99), s.latency.maximum);
+        if (s.handler.count > 0) {
+            http.printf(" handler=%lu avg=%luus max=%luus", s.handler.count, s.handler.average(), s.handler.maximum);
+        }
+        http.printf("\n");
+    }
+}
+
+static int pack32(unsigned char *buf, unsigned long v)
+{
+    buf[0] = v;
+    buf[1] = v >> 8;
+    buf[2] = v >> 16;
+    buf[3] = v >> 24;
+    return 4;
+}
+
+//
+// Binary form: version, nstats, nerrors, nbuckets, followed by per stat: 
+// addr, cmd, count, errors[1..], bytes_out, bytes_in, total_us, max_us, buckets[].
+// All counters are 32 bit little endian.
+//
+int BusStats::packed_size(int nstats)
+{
+    return 4 + nstats * (2 + 4 * (1 + (BUS_NERRORS - 1) + 4 + HISTOGRAM_BUCKETS));
+}
+
+int BusStats::pack(unsigned char *buf, int buflen)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    if (buflen < packed_size(nstats)) {
+        return -1;
+    }
+    int n = 0;
+    buf[n++] = BUS_STATS_VERSION;
+    buf[n++] = nstats;
+    buf[n++] = BUS_NERRORS - 1;
+    buf[n++] = HISTOGRAM_BUCKETS;
+    for (int i = 0 ; i < nstats ; i++) {
+        BusStat &s = stats[i];
+        buf[n++] = s.addr;
+        buf[n++] = s.cmd;
+        n += pack32(buf + n, s.count);
+        for (int e = 1 ; e < BUS_NERRORS ; e++) {
+            n += pack32(buf + n, s.errors[e]);
         }
-        client->response.resize(0);
+        n += pack32(buf + n, s.bytes_out);
+        n += pack32(buf + n, s.bytes_in);
+        n += pack32(buf + n, (unsigned long)s.latency.total);
+        n += pack32(buf + n, s.latency.maximum);
+        for (int b = 0 ; b < HISTOGRAM_BUCKETS ; b++) {
+            n += pack32(buf + n, s.latency.buckets[b]);
+        }
+    }
+    return n;
+}
+
+static BusStats *http_stats = NULL;
+static BusMaster *http_master = NULL;
+
+static void add_stats_handlers(BusStats *stats)
+{
+    http_stats = stats;
+    WebServer::add("/bus", [](HTTP &http) {
+        if (http.param.count("reset")) {
+            http_stats->reset();
+        }
+        http.header(200, "Bus Stats Follow");
+        http.printf("Content-Type: text/plain\n");
+        http.body();
+        if (http_master != NULL) {
+            http_master->print_devices(http);
+        }
+        http_stats->print(http);
+        http.close();
+    });
+    WebServer::add("/bus.bin", [](HTTP &http) {
+        int buflen = BusStats::packed_size(BUS_NSTATS);
+        auto buf = std::unique_ptr<unsigned char[]>(new unsigned char[buflen]);
+        int n = http_stats->pack(buf.get(), buflen);
+        if (n < 0) {
+            http.header(500, "Bus Stats Too Large");
+            http.close();
+            return;
+        }
+        http.header(200, "Bus Stats Follow");
+        http.printf("Content-Type: application/octet-stream\n");
+        http.printf("Content-Length: %d\n", n);
+        http.body();
+        http.write(buf.get(), n);
+        http.close();
+    });
+}
+
+//
+// Client
+//
+
+void BusSlave::receive(const unsigned char *buf, int len)
+{
+    if (len < 1) {
+        return;
+    }
+    if (buf[0] == BUS_SOF) {
+        receive_frame(buf, len);
+        return;
+    }
+    last_cmd = buf[0];
+    last_len = len;
+    if (buf[0] == CMD_HELLO) {
+        // new master session, forget the cached response
+        last_frame.resize(0);
+        response = {BUS_MAGIC, BUS_PROTO_VERSION};
+        last_us = micros();
+        return;
+    }
+    if (buf[0] == CMD_INFO) {
+        info(response);
+        last_us = micros();
+        return;
+    }
+    Buffer cmd(buf, buf + len);
+    unsigned long tm = micros();
+    int_handler(*this, cmd, response);
+    last_us = micros();
+    if (response.size() == 0) {    
+        pending.push_back(cmd);
+        wake();
+        stats.record(addr, cmd[0], last_us - tm, 0, len);
+    }
+}
+
+static void make_frame(BusSlave::Buffer &frame, uint8_t status, uint8_t seq, const unsigned char *payload, int len)
+{
+    frame.resize(len + BUS_FRAME_OVERHEAD);
+    frame[0] = status;
+    frame[1] = seq;
+    frame[2] = len;
+    if (len > 0) {
+        memcpy(frame.data() + 3, payload, len);
+    }
+    frame[len + 3] = bus_crc8(frame.data(), len + 3);
+}
+
+void BusSlave::receive_frame(const unsigned char *buf, int len)
+{
+    int plen = len - BUS_FRAME_OVERHEAD;
+    last_len = len;
+    last_us = micros();
+    if (plen < 1 || buf[1] != plen || buf[len-1] != bus_crc8(buf + 1, len - 2)) {
+        last_cmd = plen >= 1 ? buf[3] : 0;
+        make_frame(response, BUS_FRAME_BAD_CRC, len >= 3 ? buf[2] : 0, NULL, 0);
+        stats.record(addr, last_cmd, 0, 0, len, BUS_ERR_CRC);
+        return;
+    }
+    uint8_t seq = buf[2];
+    const unsigned char *payload = buf + 3;
+    last_cmd = payload[0];
+    if (seq == last_seq && last_frame.size() > 0 && last_req.size() == plen && memcmp(last_req.data(), payload, plen) == 0) {
+        // retry, the command was already handled
+        response = last_frame;
+        return;
+    }
+    Buffer cmd(payload, payload + plen);
+    Buffer res;
+    if (cmd[0] == CMD_INFO) {
+        info(res);
     } else {
+        int_handler(*this, cmd, res);
+    }
+    if (res.size() == 0) {
+        pending.push_back(cmd);
+        wake();
+    }
+    make_frame(response, BUS_FRAME_OK, seq, res.data(), res.size());
+    last_seq = seq;
+    last_req = cmd;
+    last_frame = response;
+    last_us = micros();
+}
+
+void BusSlave::info(Buffer &res)
+{
+    res = {role, BUS_PROTO_VERSION, (unsigned char)caps, (unsigned char)(caps >> 8)};
+}
+
+int BusSlave::respond(unsigned char *buf, int len)
+{
+    if (response.size() == 0) {
         dprintf("bus: error, missing request data");
+        stats.record(addr, last_cmd, micros() - last_us, 0, last_len, BUS_ERR_SHORT);
+        return 0;
     }
+    int n = min(len, (int)response.size());
+    memcpy(buf, response.data(), n);
+    stats.record(addr, last_cmd, micros() - last_us, n, last_len);
+    response.resize(0);
+    return n;
 }
 
 void BusSlave::init()
 {
-    client = this;
-    Wire.begin(addr);
-    Wire.setTimeOut(1000);
-    Wire.setBufferSize(128);
-    Wire.onReceive(handleReceiveCommand);
-    Wire.onRequest(handleRequestData);
+    transport.begin_slave(this);
+    add_stats_handlers(&stats);
 }
 
 void BusSlave::idle(unsigned long now)
@@ -48,9 +322,11 @@ void BusSlave::idle(unsigned long now)
         noInterrupts();
         Buffer cmd = pending[0];
         pending.erase(pending.begin());
-        interval = pending.size() == 0 ? 1000 : 0;
+        schedule(pending.size() == 0 ? 1000 : 0);
         interrupts();
+        unsigned long tm = micros();
         cmd_handler(*this, cmd);
+        stats.record_handler(addr, cmd[0], micros() - tm);
    }
 }
 
@@ -58,62 +334,419 @@ void BusSlave::idle(unsigned long now)
 // BusMaster
 //
 
+//
+// Devices that are not discovered yet, or can not tell their role.
+//
+static const struct {
+    uint8_t addr;
+    uint8_t role;
+    uint8_t protocol;
+} known_devices[] = {
+    {CAMERA_ADDR, BUS_ROLE_CAMERA, BUS_PROTO_UNKNOWN},
+    {AS5600_ADDR, BUS_ROLE_ANGLE, BUS_PROTO_RAW},
+};
+
 void BusMaster::init()
 {
-    Wire.begin();
-    Wire.setTimeOut(1000);
-    Wire.setBufferSize(128);
+    transport.begin_master();
+    for (auto &k : known_devices) {
+        if (k.protocol != BUS_PROTO_UNKNOWN) {
+            set_protocol(k.addr, (BusProtocol)k.protocol);
+        }
+    }
+    for (int addr = BUS_SCAN_FIRST ; addr <= BUS_SCAN_LAST ; addr++) {
+        scan(addr);
+    }
+    dprintf("bus: found %d devices", devices.size());
+    http_master = this;
+    add_stats_handlers(&stats);
+}
+
+// probe one address per idle, so new devices are found without stalling
+void BusMaster::idle(unsigned long now)
+{
+    scan(scan_addr);
+    scan_addr = scan_addr >= BUS_SCAN_LAST ? BUS_SCAN_FIRST : scan_addr + 1;
+}
+
+void BusMaster::scan(uint8_t addr)
+{
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    BusDevice *dev = NULL;
+    for (auto &d : devices) {
+        if (d.addr == addr) {
+            dev = &d;
+        }
+    }
+    unsigned long now = millis();
+    if (dev != NULL && dev->backoff_until > now) {
+        return;
+    }
+    bool found = check(addr);
+    if (!found) {
+        if (dev != NULL) {
+            update_health(*dev, false, now);
+        }
+        return;
+    }
+    bool known = dev != NULL && dev->health != BUS_HEALTH_DOWN && dev->role != BUS_ROLE_UNKNOWN;
+    dev = device(addr);
+    update_health(*dev, true, now);
+    if (!known && identifiable(addr)) {
+        identify(*dev);
+    }
+}
+
+// only talk to addresses we expect, or that already answered the
+// HELLO magic, a foreign device that ACKs is listed but left alone
+bool BusMaster::identifiable(uint8_t addr)
+{
+    for (auto &k : known_devices) {
+        if (k.addr == addr) {
+            return true;
+        }
+    }
+    return protocol[addr] == BUS_PROTO_FRAMED;
+}
+
+BusDevice *BusMaster::device(uint8_t addr)
+{
+    for (auto &d : devices) {
+        if (d.addr == addr) {
+            return &d;
+        }
+    }
+    BusDevice dev;
+    bzero(&dev, sizeof(dev));
+    dev.addr = addr;
+    dev.health = BUS_HEALTH_DOWN;
+    for (auto &k : known_devices) {
+        if (k.addr == addr) {
+            dev.role = k.role;
+        }
+    }
+    devices.push_back(dev);
+    return &devices.back();
+}
+
+void BusMaster::identify(BusDevice &dev)
+{
+    uint8_t addr = dev.addr;
+    if (protocol[addr] == BUS_PROTO_UNKNOWN) {
+        negotiate(addr);
+    }
+    unsigned char res[4];
+    if (protocol[addr] == BUS_PROTO_FRAMED && transact(addr, (const unsigned char []){CMD_INFO}, 1, res, sizeof(res))) {
+        BusDevice *d = device(addr);
+        d->role = res[0];
+        d->version = res[1];
+        d->caps = res[2] | (res[3] << 8);
+    }
+    BusDevice *d = device(addr);
+    dprintf("bus: 0x%02x, %s, version=%d, caps=0x%04x", addr, bus_role_name(d->role), d->version, d->caps);
+}
+
+void BusMaster::update_health(BusDevice &dev, bool ok, unsigned long now)
+{
+    if (ok) {
+        if (dev.health != BUS_HEALTH_OK) {
+            dprintf("bus: 0x%02x, %s is up", dev.addr, bus_role_name(dev.role));
+        }
+        dev.health = BUS_HEALTH_OK;
+        dev.failures = 0;
+        dev.backoff = 0;
+        dev.backoff_until = 0;
+        dev.last_seen = now;
+        return;
+    }
+    dev.failures = min(dev.failures + 1, 255);
+    if (dev.failures >= BUS_FLAKY_FAILURES) {
+        dev.backoff = max(BUS_BACKOFF_MIN, min(2 * dev.backoff, BUS_BACKOFF_MAX));
+        dev.backoff_until = now + dev.backoff;
+        if (dev.health == BUS_HEALTH_OK) {
+            dprintf("bus: 0x%02x, %s is flaky, backing off", dev.addr, bus_role_name(dev.role));
+        }
+        dev.health = dev.failures >= BUS_DOWN_FAILURES ? BUS_HEALTH_DOWN : BUS_HEALTH_FLAKY;
+    }
+}
+
+// the first healthy device with this role, or the default address
+int BusMaster::lookup(BusRole role)
+{
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    int addr = -1;
+    for (auto &d : devices) {
+        if (d.role == role) {
+            if (d.health == BUS_HEALTH_OK) {
+                return d.addr;
+            }
+            if (addr < 0) {
+                addr = d.addr;
+            }
+        }
+    }
+    if (addr < 0) {
+        for (auto &k : known_devices) {
+            if (k.role == role) {
+                return k.addr;
+            }
+        }
+    }
+    return addr;
+}
+
+void BusMaster::print_devices(HTTP &http)
+{
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    unsigned long now = millis();
+    for (auto &d : devices) {
+        const char *health = d.health == BUS_HEALTH_OK ? "ok" : d.health == BUS_HEALTH_FLAKY ? "flaky" : "down";
+        http.printf("device 0x%02x %s version=%d caps=0x%04x %s %s failures=%d seen=%lums ago\n", d.addr, bus_role_name(d.role), d.version, d.caps,
+            protocol[d.addr] == BUS_PROTO_FRAMED ? "framed" : "raw", health, d.failures, d.last_seen == 0 ? 0 : now - d.last_seen);
+    }
 }
 
 bool BusMaster::check(uint8_t addr)
 {
-    Wire.beginTransmission(addr);
-    int error = Wire.endTransmission();
-    return error == 0;
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    return transport.transmit(addr, NULL, 0) == BUS_OK;
+}
+
+// single transaction, returns a BusError
+int BusMaster::transfer(uint8_t addr, const unsigned char *req, int reqlen, unsigned char *res, int reslen)
+{
+    int error = transport.transmit(addr, req, reqlen);
+    if (error == BUS_OK && reslen > 0 && transport.receive(addr, res, reslen) != reslen) {
+        error = BUS_ERR_SHORT;
+    }
+    return error;
+}
+
+int BusMaster::negotiate(uint8_t addr)
+{
+    unsigned char req[1] = {CMD_HELLO};
+    unsigned char res[2] = {0, 0};
+    unsigned long tm = micros();
+    int error = transfer(addr, req, sizeof(req), res, sizeof(res));
+    stats.record(addr, CMD_HELLO, micros() - tm, sizeof(req), error == BUS_OK ? sizeof(res) : 0, error);
+    if (error == BUS_ERR_NACK_ADDR) {
+        // not there (yet), try again later
+        return BUS_PROTO_UNKNOWN;
+    }
+    // old firmware does not answer CMD_HELLO at all, so after a few
+    // errors from a device that is there it is raw, a lost reply from
+    // a framed slave is retried
+    BusDevice *dev = device(addr);
+    if (error != BUS_OK && ++dev->hello_failures < BUS_HELLO_FAILURES) {
+        return BUS_PROTO_UNKNOWN;
+    }
+    dev->hello_failures = 0;
+    // a complete reply without the magic is an old raw slave too
+    int proto = error == BUS_OK && res[0] == BUS_MAGIC && res[1] >= 1 ? BUS_PROTO_FRAMED : BUS_PROTO_RAW;
+    set_protocol(addr, (BusProtocol)proto);
+    dprintf("bus: 0x%02x, using %s protocol", addr, proto == BUS_PROTO_FRAMED ? "framed" : "raw");
+    if (proto == BUS_PROTO_FRAMED && clock_hz < BUS_CLOCK_FAST) {
+        // corrupted frames are retried, so a faster clock is safe
+        clock_hz = BUS_CLOCK_FAST;
+        transport.set_clock(clock_hz);
+        dprintf("bus: clock set to %luHz", (unsigned long)clock_hz);
+    }
+    return proto;
+}
+
+bool BusMaster::request(BusRole role, const unsigned char *req, int reqlen, unsigned char *res, int reslen)
+{
+    int addr = lookup(role);
+    if (addr < 0) {
+        if (res != NULL && reslen > 0) {
+            bzero(res, reslen);
+        }
+        return false;
+    }
+    return request((uint8_t)addr, req, reqlen, res, reslen);
 }
 
 bool BusMaster::request(uint8_t addr, const unsigned char *req, int reqlen, unsigned char *res, int reslen)
 {
-    if (res != NULL && reslen > 0) {
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    BusDevice *dev = device(addr);
+    unsigned long now = millis();
+    if (dev->backoff_until > now) {
+        if (res != NULL && reslen > 0) {
+            bzero(res, reslen);
+        }
+        stats.record(addr, reqlen > 0 ? req[0] : 0, 0, 0, 0, BUS_ERR_BACKOFF);
+        return false;
+    }
+    bool ok = transact(addr, req, reqlen, res, reslen);
+    update_health(*device(addr), ok, now);
+    return ok;
+}
+
+bool BusMaster::transact(uint8_t addr, const unsigned char *req, int reqlen, unsigned char *res, int reslen)
+{
+    if (res == NULL) {
+        reslen = 0;
+    }
+    if (reslen > 0) {
         bzero(res, reslen);
     }
     if (reqlen < 1) {
         dprintf("bus: error, request too short, reqlen=%d", reqlen);
         return false;
     }
+    if (protocol[addr & 0x7F] == BUS_PROTO_UNKNOWN) {
+        negotiate(addr);
+    }
+    if (protocol[addr & 0x7F] == BUS_PROTO_FRAMED) {
+        return request_framed(addr, req, reqlen, res, reslen);
+    }
+
+    // a failed write is not followed by a read, the original code only
+    // gave up on the first error at an address and then read anyway
     static int last_error_addr = -1;
-    Wire.beginTransmission(addr);
-    Wire.write(req, reqlen);
-    int error = Wire.endTransmission();
-    if (error != 0) {
+    unsigned long tm = micros();
+    int error = transfer(addr, req, reqlen, res, reslen);
+    stats.record(addr, req[0], micros() - tm, reqlen, error == BUS_OK ? reslen : 0, error);
+    if (error != BUS_OK) {
         if (last_error_addr != addr) {
-            dprintf("bus: 0x%02x, error in endTransmission, %d", addr, error);
+            dprintf("bus: 0x%02x, error in request 0x%02x, %s", addr, req[0], bus_error_name(error));
             last_error_addr = addr;
-            return false;
         }
-    } else {
-        //dprintf("bus: 0x%02x, sent 0x%02x %d, reslen=%d", addr, req[0], reqlen, reslen);
-    }
-    if (res != NULL && reslen > 0) {
-        //delay(5);
-        int n = Wire.requestFrom(int(addr), reslen);
-        if (n != reslen) {
-            if (last_error_addr != addr) {
-                dprintf("bus: 0x%02x, error, requested %d, got %d", addr, reslen, n);
-                last_error_addr = addr;
-                for (int i = 0 ; i < reslen ; i++) {
-                    res[i] = 0;
-                }
+        if (reslen > 0) {
+            bzero(res, reslen);
+        }
+        return false;
+    }
+    return true;
+}
+
+bool BusMaster::request_framed(uint8_t addr, const unsigned char *req, int reqlen, unsigned char *res, int reslen)
+{
+    unsigned char frame[128];
+    unsigned char ack[128];
+    int framelen = reqlen + BUS_FRAME_OVERHEAD;
+    int acklen = reslen + BUS_FRAME_OVERHEAD;
+    if (framelen > sizeof(frame) || acklen > sizeof(ack)) {
+        stats.record(addr, req[0], 0, 0, 0, BUS_ERR_LENGTH);
+        return false;
+    }
+    seq += 1;
+    frame[0] = BUS_SOF;
+    frame[1] = reqlen;
+    frame[2] = seq;
+    memcpy(frame + 3, req, reqlen);
+    frame[framelen - 1] = bus_crc8(frame + 1, framelen - 2);
+
+    int error = BUS_OK;
+    for (int attempt = 0 ; attempt <= BUS_RETRIES ; attempt++) {
+        unsigned long tm = micros();
+        error = transfer(addr, frame, framelen, ack, acklen);
+        if (error == BUS_OK) {
+            if (ack[0] != BUS_FRAME_OK || ack[acklen - 1] != bus_crc8(ack, acklen - 1)) {
+                error = BUS_ERR_CRC;
+            } else if (ack[1] != seq) {
+                error = BUS_ERR_SEQ;
+            } else if (ack[2] != reslen) {
+                error = BUS_ERR_SHORT;
             }
-            for (int i = 0 ; i < n ; i++) {
-                Wire.read();
+        }
+        stats.record(addr, req[0], micros() - tm, framelen, error == BUS_OK ? acklen : 0, error);
+        if (error == BUS_OK) {
+            if (reslen > 0) {
+                memcpy(res, ack + 3, reslen);
             }
-            last_error_addr = addr;
-            return false;
+            return true;
+        }
+        if (error == BUS_ERR_NACK_ADDR) {
+            break;
         }
-        //dprintf("reading %d bytes", reslen);
-        Wire.readBytes(res, reslen);
-        Wire.flush();
     }
-    return true;
-}
\ No newline at end of file
+    static int last_error_addr = -1;
+    if (last_error_addr != addr) {
+        dprintf("bus: 0x%02x, error in framed request 0x%02x, %s", addr, req[0], bus_error_name(error));
+        last_error_addr = addr;
+    }
+    return false;
+}
+
+unsigned long BusMaster::transactions()
+{
+    unsigned long n = 0;
+    for (int i = 0 ; i < stats.nstats ; i++) {
+        n += stats.stats[i].count;
+    }
+    return n;
+}
+
+//
+// WireTransport
+//
+WireTransport wire_transport;
+static BusSlave *client = NULL;
+
+static void handleReceiveCommand(int len) 
+{
+    BusSlave::Buffer cmd(len);
+    Wire.readBytes(cmd.data(), len);
+    client->receive(cmd.data(), len);
+}
+
+static void handleRequestData() 
+{
+    unsigned char buf[128];
+    int n = client->respond(buf, sizeof(buf));
+    if (n > 0) {
+        int w = Wire.write(buf, n);
+        if (w != n) {
+            dprintf("bus: hdlreqd FAILED 0x%02x len=%d, wrote %d", buf[0], n, w);
+            client->stats.record(client->addr, client->last_cmd, 0, 0, 0, BUS_ERR_LENGTH);
+        }
+    }
+}
+
+void WireTransport::begin_master()
+{
+    Wire.begin();
+    Wire.setTimeOut(1000);
+    Wire.setBufferSize(128);
+}
+
+void WireTransport::begin_slave(BusSlave *slave)
+{
+    client = slave;
+    Wire.begin(slave->addr);
+    Wire.setTimeOut(1000);
+    Wire.setBufferSize(128);
+    Wire.onReceive(handleReceiveCommand);
+    Wire.onRequest(handleRequestData);
+}
+
+void WireTransport::set_clock(uint32_t hz)
+{
+    Wire.setClock(hz);
+}
+
+int WireTransport::transmit(uint8_t addr, const unsigned char *buf, int len)
+{
+    Wire.beginTransmission(addr);
+    if (len > 0) {
+        Wire.write(buf, len);
+    }
+    int error = Wire.endTransmission();
+    return error < BUS_ERR_SHORT ? error : BUS_ERR_OTHER;
+}
+
+int WireTransport::receive(uint8_t addr, unsigned char *buf, int len)
+{
+    int n = Wire.requestFrom(int(addr), len);
+    if (n != len) {
+        for (int i = 0 ; i < n ; i++) {
+            Wire.read();
+        }
+        return n;
+    }
+    Wire.readBytes(buf, len);
+    Wire.flush();
+    return n;
+}
@@ -3,6 +3,174 @@
 #pragma once
 #include "util.h"
 
+#define BUS_NSTATS          32      // max number of (addr, cmd) pairs tracked
+#define BUS_STATS_VERSION   1       // version of the binary stats format
+
+//
+// Framed protocol. A master sends CMD_HELLO unframed, a slave that speaks
+// the framed protocol responds with BUS_MAGIC and its version, old firmware
+// does not respond and keeps getting raw commands.
+//
+// request:  BUS_SOF, len, seq, payload[len], crc8
+// response: status, seq, len, payload[len], crc8
+//
+// Every framed request is acknowledged with a response frame. A retry
+// reuses the sequence number, the slave then resends the cached response
+// instead of handling the command again.
+//
+#define BUS_SOF             0xA5
+#define BUS_MAGIC           0xB5
+#define BUS_PROTO_VERSION   1
+#define BUS_FRAME_OVERHEAD  4
+#define BUS_RETRIES         3
+#define BUS_CLOCK_DEFAULT   100000
+#define BUS_CLOCK_FAST      400000
+
+enum BusProtocol {
+    BUS_PROTO_UNKNOWN,
+    BUS_PROTO_RAW,
+    BUS_PROTO_FRAMED,
+};
+
+enum BusFrameStatus {
+    BUS_FRAME_OK,
+    BUS_FRAME_BAD_CRC,
+};
+
+//
+// Device registry. The master scans the bus at boot and in the background,
+// framed slaves report their role and capabilities in response to CMD_INFO:
+// role, version, caps (16 bit little endian). Requests are routed by role, 
+// a device that keeps failing is backed off instead of stalling the caller.
+//
+#define BUS_SCAN_FIRST      0x08
+#define BUS_SCAN_LAST       0x77
+#define BUS_SCAN_INTERVAL   250     // ms between background probes
+#define BUS_FLAKY_FAILURES  3       // consecutive failures before backing off
+#define BUS_DOWN_FAILURES   10
+#define BUS_BACKOFF_MIN     100     // ms
+#define BUS_BACKOFF_MAX     5000    // ms
+#define BUS_HELLO_FAILURES  3       // failed hellos of a device that is there before it is raw
+
+enum BusRole {
+    BUS_ROLE_UNKNOWN,
+    BUS_ROLE_CAMERA,
+    BUS_ROLE_FACE_CAMERA,
+    BUS_ROLE_ANGLE,
+    BUS_NROLES,
+};
+
+#define BUS_CAP_CAPTURE     0x0001
+#define BUS_CAP_LEARN       0x0002
+#define BUS_CAP_STATUS      0x0004
+#define BUS_CAP_TRACE       0x0008  // CMD_TIME, CMD_SPANS and trace ids
+
+enum BusHealth {
+    BUS_HEALTH_OK,
+    BUS_HEALTH_FLAKY,
+    BUS_HEALTH_DOWN,
+};
+
+struct BusDevice {
+    uint8_t addr;
+    uint8_t role;
+    uint8_t version;
+    uint16_t caps;
+    uint8_t health;
+    uint8_t failures;               // consecutive
+    uint8_t hello_failures;         // CMD_HELLO answered with an error
+    unsigned long last_seen;
+    unsigned long backoff;
+    unsigned long backoff_until;
+};
+
+extern const char *bus_role_name(int role);
+extern uint8_t bus_crc8(const unsigned char *buf, int len, uint8_t crc = 0);
+
+//
+// Transaction errors, the first 6 match the Wire endTransmission() codes.
+//
+enum BusError {
+    BUS_OK,
+    BUS_ERR_LENGTH,         // data too long for buffer
+    BUS_ERR_NACK_ADDR,      // address not acknowledged
+    BUS_ERR_NACK_DATA,      // data not acknowledged
+    BUS_ERR_OTHER,
+    BUS_ERR_TIMEOUT,
+    BUS_ERR_SHORT,          // response shorter than requested
+    BUS_ERR_CRC,            // corrupted frame, in either direction
+    BUS_ERR_SEQ,            // response for another request
+    BUS_ERR_BACKOFF,        // not sent, device is backed off
+    BUS_NERRORS,
+};
+
+extern const char *bus_error_name(int error);
+
+//
+// Per address, per command transaction counters.
+//
+struct BusStat {
+    uint8_t addr;
+    uint8_t cmd;
+    unsigned long count;
+    unsigned long errors[BUS_NERRORS];
+    unsigned long bytes_out;
+    unsigned long bytes_in;
+    Histogram latency;              // transfers
+    Histogram handler;              // slave command handler, not counted in count
+};
+
+//
+// Slaves record from the Wire callback task, so all access is locked.
+//
+class BusStats {
+  public:
+    BusStat stats[BUS_NSTATS];
+    int nstats = 0;
+    std::mutex lock;
+
+  public:
+    void record(uint8_t addr, uint8_t cmd, unsigned long us, int out, int in, int error = BUS_OK);
+    void record_handler(uint8_t addr, uint8_t cmd, unsigned long us);
+    void reset();
+    void print(class HTTP &http);
+    int pack(unsigned char *buf, int buflen);
+    static int packed_size(int nstats);
+  private:
+    BusStat *lookup(uint8_t addr, uint8_t cmd);
+};
+
+//
+// A transport moves raw bytes between a BusMaster and its slaves.
+// The master side calls transmit/receive, the slave side is driven
+// by the transport calling BusSlave::receive and BusSlave::respond.
+//
+class BusTransport {
+  public:
+    virtual void begin_master() {}
+    virtual void begin_slave(class BusSlave *slave) {}
+    virtual void set_clock(uint32_t hz) {}
+
+    // returns a BusError
+    virtual int transmit(uint8_t addr, const unsigned char *buf, int len) = 0;
+    // returns the number of bytes received
+    virtual int receive(uint8_t addr, unsigned char *buf, int len) = 0;
+};
+
+//
+// Real I2C using the Wire library.
+//
+class WireTransport : public BusTransport {
+  public:
+    virtual void begin_master();
+    virtual void begin_slave(class BusSlave *slave);
+    virtual void set_clock(uint32_t hz);
+    virtual int transmit(uint8_t addr, const unsigned char *buf, int len);
+    virtual int receive(uint8_t addr, unsigned char *buf, int len);
+};
+
+extern WireTransport wire_transport;
+
 //
 // An IC2 bus slave must handle commands that have a response in the
 // interrupt handler and must be strictly non-blocking. 
@@ -15,23 +183,65 @@ class BusSlave : public IdleComponent {
    typedef std::vector<unsigned char> Buffer;
   public:
     uint8_t addr;
+    uint8_t role;
+    uint16_t caps;
+    BusTransport &transport;
     void (*int_handler)(BusSlave &, Buffer &, Buffer &);
     void (*cmd_handler)(BusSlave &, Buffer &);
     std::vector<Buffer> pending;
     Buffer response;
+    BusStats stats;
+    uint8_t last_cmd = 0;
+    int last_len = 0;
+    unsigned long last_us = 0;
+    uint8_t last_seq = 0;
+    Buffer last_req;
+    Buffer last_frame;
   public:
-    BusSlave(uint8_t addr, void (*int_handler)(BusSlave &, Buffer &, Buffer &), void (*cmd_handler)(BusSlave &, Buffer &)) : 
-      IdleComponent("BusClient", 1000), addr(addr), int_handler(int_handler), cmd_handler(cmd_handler) {
+    BusSlave(uint8_t addr, uint8_t role, uint16_t caps, void (*int_handler)(BusSlave &, Buffer &, Buffer &), void (*cmd_handler)(BusSlave &, Buffer &), BusTransport &transport = wire_transport) : 
+      IdleComponent("BusClient", 1000), addr(addr), role(role), caps(caps), transport(transport), int_handler(int_handler), cmd_handler(cmd_handler) {
     } 
     virtual void init();
+    void receive(const unsigned char *buf, int len);
+    int respond(unsigned char *buf, int len);
+  private:
+    void receive_frame(const unsigned char *buf, int len);
+    void info(Buffer &res);
     virtual void idle(unsigned long now);
 };
 
-class BusMaster : public InitComponent {
+class BusMaster : public IdleComponent {
   public:
-    BusMaster() : InitComponent("BusMaster") {}
+    BusTransport &transport;
+    BusStats stats;
+    uint8_t protocol[128];
+    uint8_t seq = 0;
+    uint32_t clock_hz = BUS_CLOCK_DEFAULT;
+    std::vector<BusDevice> devices;
+    uint8_t scan_addr = BUS_SCAN_FIRST;
+    std::recursive_mutex lock;      // the control loop only samples the bus when this is free
+  public:
+    BusMaster(BusTransport &transport = wire_transport) : IdleComponent("BusMaster", BUS_SCAN_INTERVAL), transport(transport) {
+      bzero(protocol, sizeof(protocol));
+    }
     virtual void init();
+    virtual void idle(unsigned long now);
 
     bool check(uint8_t addr);
     bool request(uint8_t addr, const unsigned char *req, int reqlen, unsigned char *res=NULL, int reslen=0);
-};
\ No newline at end of file
+    bool request(BusRole role, const unsigned char *req, int reqlen, unsigned char *res=NULL, int reslen=0);
+    int lookup(BusRole role);
+    BusDevice *device(uint8_t addr);
+    void scan(uint8_t addr);
+    bool identifiable(uint8_t addr);
+    void identify(BusDevice &dev);
+    void print_devices(class HTTP &http);
+    void set_protocol(uint8_t addr, BusProtocol proto) { protocol[addr & 0x7F] = proto; }
+    int negotiate(uint8_t addr);
+    unsigned long transactions();
+  private:
+    bool transact(uint8_t addr, const unsigned char *req, int reqlen, unsigned char *res, int reslen);
+    void update_health(BusDevice &dev, bool ok, unsigned long now);
+    int transfer(uint8_t addr, const unsigned char *req, int reqlen, unsigned char *res, int reslen);
+    bool request_framed(uint8_t addr, const unsigned char *req, int reqlen, unsigned char *res, int reslen);
+};
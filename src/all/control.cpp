@@ -0,0 +1,124 @@
+// (c)2024, Arthur van Hoff, Artfahrt Inc.
+
+#include "control.h"
+#include "webserver.h"
+
+//
+// ControlComponent
+//
+ControlComponent *ControlComponent::first = NULL;
+
+void ControlComponent::step_all(unsigned long tick, unsigned long now_us)
+{
+    for (ControlComponent *p = first ; p != NULL ; p = p->next) {
+      if (tick % p->divider == 0) {
+        float dt = p->last_us == 0 ? 0 : (now_us - p->last_us) / 1000000.0f;
+        p->control(now_us, dt);
+        p->last_us = now_us;
+      }
+    }
+}
+
+//
+// ControlLoop
+//
+
+void ControlLoop::tick(unsigned long now_us)
+{
+    if (ticks > 0) {
+      long late = long(now_us - last_us) - long(period_us);
+      jitter.add(abs(late));
+    }
+    last_us = now_us;
+    ControlComponent::step_all(ticks, now_us);
+    unsigned long us = micros() - now_us;
+    duration.add(us);
+    if (us > period_us) {
+      overruns += 1;
+    }
+    ticks += 1;
+}
+
+void ControlLoop::reset()
+{
+    ticks = 0;
+    overruns = 0;
+    missed = 0;
+    jitter.reset();
+    duration.reset();
+}
+
+static ControlLoop *http_loop = NULL;
+
+static void add_control_handler(ControlLoop *loop)
+{
+    http_loop = loop;
+    WebServer::add("/control", [](HTTP &http) {
+      ControlLoop &l = *http_loop;
+      http.header(200, "Control Loop Stats");
+      http.printf("Content-Type: text/plain\n");
+      http.body();
+      http.printf("rate=%dHz ticks=%lu overruns=%lu missed=%lu\n", l.hz, l.ticks, l.overruns, l.missed);
+      http.printf("jitter avg=%luus p99=%luus max=%luus\n", l.jitter.average(), l.jitter.percentile(99), l.jitter.maximum);
+      http.printf("step avg=%luus p99=%luus max=%luus\n", l.duration.average(), l.duration.percentile(99), l.duration.maximum);
+      for (ControlComponent *p = ControlComponent::first ; p != NULL ; p = p->next) {
+        http.printf("component %s every %d ticks\n", p->name, p->divider);
+      }
+      http.close();
+      if (http.param.count("reset")) {
+        l.reset();
+      }
+    });
+}
+
+#ifdef ARDUINO
+#include <esp_timer.h>
+
+static TaskHandle_t control_task = NULL;
+static esp_timer_handle_t control_timer = NULL;
+
+static void control_timer_callback(void *arg)
+{
+    xTaskNotifyGive(control_task);
+}
+
+static void control_task_main(void *arg)
+{
+    ControlLoop *loop = (ControlLoop *)arg;
+    for (;;) {
+      uint32_t n = ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+      if (n > 1) {
+        loop->missed += n - 1;
+      }
+      loop->tick(micros());
+    }
+}
+
+void ControlLoop::init()
+{
+    add_control_handler(this);
+    xTaskCreatePinnedToCore(control_task_main, name, 8192, this, configMAX_PRIORITIES - 2, &control_task, ARDUINO_RUNNING_CORE);
+    esp_timer_create_args_t args = {};
+    args.callback = control_timer_callback;
+    args.name = name;
+    esp_timer_create(&args, &control_timer);
+    esp_timer_start_periodic(control_timer, period_us);
+    dprintf("control: running at %dHz", hz);
+}
+
+void ControlLoop::halt()
+{
+    if (control_timer != NULL) {
+      esp_timer_stop(control_timer);
+    }
+}
+#else
+void ControlLoop::init()
+{
+    add_control_handler(this);
+}
+
+void ControlLoop::halt()
+{
+}
+#endif
@@ -0,0 +1,55 @@
+// (c)2024, Arthur van Hoff, Artfahrt Inc.
+#pragma once
+
+#include "util.h"
+
+#define CONTROL_HZ          1000
+
+//
+// Control components are stepped at a fixed rate by the ControlLoop,
+// independent of how long the idle loop takes. A component with
+// divider n is stepped every n ticks, dt is the measured time in
+// seconds since its previous step.
+//
+class ControlComponent : public InitComponent {
+  public:
+    int divider;
+    unsigned long last_us = 0;
+    ControlComponent *next = NULL;
+    static ControlComponent *first;
+
+  public:
+    ControlComponent(const char *name, int divider = 1) : InitComponent(name), divider(divider) {
+      ControlComponent **p = &first;
+      for (; *p != NULL ; p = &(*p)->next);
+      *p = this;
+    }
+
+    virtual void control(unsigned long now_us, float dt) {}
+
+    static void step_all(unsigned long tick, unsigned long now_us);
+};
+
+//
+// On the device the loop runs in a high priority task that is woken by 
+// a hardware timer. On the host, call tick() from a virtual clock.
+//
+class ControlLoop : public InitComponent {
+  public:
+    int hz;
+    unsigned long period_us;
+    unsigned long ticks = 0;
+    unsigned long last_us = 0;
+    unsigned long overruns = 0;     // steps that took longer than a period
+    unsigned long missed = 0;       // timer ticks that were dropped
+    Histogram jitter;               // deviation from the period, in micros
+    Histogram duration;             // time spent in a step, in micros
+
+  public:
+    ControlLoop(const char *name, int hz = CONTROL_HZ) : InitComponent(name), hz(hz), period_us(1000000 / hz) {}
+    virtual void init();
+    virtual void halt();
+
+    void tick(unsigned long now_us);
+    void reset();
+};
@@ -10,10 +10,39 @@ char card2ch(int c)
     return (c < 0 || c >= SUITLEN) ? '?' : "23456789TJQKA"[c];
 }
 
+//
+// Character classes for parsing, one lookup per character.
+//
+#define DEAL_CH_SUIT        16      // suit letter, plus the suit
+#define DEAL_CH_DOT         32      // next suit
+#define DEAL_CH_HAND        33      // next hand
+#define DEAL_CH_BAD         64
+
+static struct DealTable {
+    unsigned char cls[256];
+    signed char player[256];
+
+    DealTable() {
+        memset(cls, DEAL_CH_BAD, sizeof(cls));
+        memset(player, -1, sizeof(player));
+        for (int i = 0 ; i < SUITLEN ; i++) {
+            cls[(unsigned char)"23456789TJQKA"[i]] = i;
+        }
+        for (int i = 0 ; i < NSUITS ; i++) {
+            cls[(unsigned char)"CDHS"[i]] = DEAL_CH_SUIT + i;
+        }
+        for (int i = 0 ; i < NPLAYERS ; i++) {
+            player[(unsigned char)"NESW"[i]] = i;
+        }
+        cls['.'] = DEAL_CH_DOT;
+        cls['|'] = cls[','] = cls[' '] = DEAL_CH_HAND;
+    }
+} deal_table;
+
 int ch2card(char c)
 {
-    const char *p = strchr("23456789TJQKA", c);
-    return p ? p - "23456789TJQKA" : CARD_NULL;
+    int k = deal_table.cls[(unsigned char)c];
+    return k < SUITLEN ? k : CARD_NULL;
 }
 
 char suit2ch(int s)
@@ -33,8 +62,8 @@ const char *suit2sym(int s)
 }
 int ch2suit(char c)
 {
-    const char *p = strchr("CDHS", c);
-    return p ? p - "CDHS" : -1;
+    int k = deal_table.cls[(unsigned char)c];
+    return k >= DEAL_CH_SUIT && k < DEAL_CH_SUIT + NSUITS ? k - DEAL_CH_SUIT : -1;
 }
 
 char player2ch(int p)
@@ -55,8 +84,7 @@ const char *player2str(int p)
 
 int ch2player(char c)
 {
-    const char *p = strchr("NESW", c);
-    return p ? p - "NESW" : -1;
+    return deal_table.player[(unsigned char)c];
 }
 
 int card2hcp(int c) 
@@ -118,104 +146,606 @@ extern const char *full_name(int cs)
     return full_name_buf;
 }
 
-bool Deal::parse(const char *str)
+//
+// Random numbers for completing deals, xorshift64* seeded from the
+// hardware, with an unbiased range (Lemire).
+//
+static uint64_t deal_rng;
+
+uint32_t deal_random(uint32_t n)
 {
-    for (int i = 0 ; i < DECKLEN ; i++) {
-        owner[i] = CARD_NULL;
+    if (deal_rng == 0) {
+        deal_rng = ((uint64_t)esp_random() << 32) | esp_random() | 1;
     }
-    for (int p = 0 ; p < NPLAYERS ; p++) {
-        for (int c = 0 ; c < HANDSIZE ; c++) {
-            cards[p][c] = CARD_NULL;
+    for (;;) {
+        deal_rng ^= deal_rng >> 12;
+        deal_rng ^= deal_rng << 25;
+        deal_rng ^= deal_rng >> 27;
+        uint64_t m = ((deal_rng * 0x2545F4914F6CDD1DULL) >> 32) * n;
+        uint32_t l = (uint32_t)m;
+        if (l >= n || l >= (uint32_t)(-n) % n) {
+            return m >> 32;
         }
     }
-    
+}
+
+bool Deal::parse(const char *str)
+{
+    memset(owner, CARD_NULL, sizeof(owner));
     dealer = NORTH;
 
-    dprintf("DEAL: '%s'", str);
+    //dprintf("DEAL: '%s'", str);
 
-    const char *p = str;
+    const unsigned char *p = (const unsigned char *)str;
     if (p[0] != '\0' && p[1] == ':') {
-        dealer = ch2player(p[0]);
+        dealer = deal_table.player[p[0]];
         p += 2;
     }
     if (dealer < 0) {
-        dprintf("deal: invalid dealer '%str'", str);
+        dprintf("deal: invalid dealer '%s'", str);
         return false;
     }
-    for (int player = dealer, card = 0, suit = 3 ; *p != '\0' ;) {
-        if (*p == '|' || *p == ',' || *p == ' ') {
-            p++;
-            player = (player + 1) % 4;
-            card = 0;
-            suit = 3;
-            continue;
-        }
-        if (*p == '.') {
-            p++;
+    int count[NPLAYERS] = {0, 0, 0, 0};
+    for (int player = dealer, suit = 3 ; *p != '\0' ; p++) {
+        int k = deal_table.cls[*p];
+        if (k < SUITLEN) {
+            int cs = CARDSUIT(suit, k);
+            if (owner[cs] != CARD_NULL) {
+                dprintf("deal: duplicate card %s for %s in '%s' ", short_name(cs), player2str(player), str);
+                return false;
+            }
+            if (count[player] == HANDSIZE) {
+                dprintf("deal: too many cards for %s in '%s'", player2str(player), str);
+                return false;
+            }
+            owner[cs] = player;
+            count[player]++;
+        } else if (k == DEAL_CH_DOT) {
             if (suit == 0) {
                 dprintf("deal: too many suits for %s in '%s' ", player2str(player), str);
                 return false;
             }
             suit--;
-            continue;
-        }
-        if (ch2suit(*p) >= 0) {
-            suit = ch2suit(*p++);
-            continue;
-        }
-        int c =  ch2card(*p++);
-        if (c < 0 || c >= SUITLEN) {
-            dprintf("deal: invalid card '%c' for %s in '%s'", p[-1], player2str(player), str);
-            return false;
-        }
-        int cs = CARDSUIT(suit, card);
-        if (owner[cs] != CARD_NULL) {
-            dprintf("deal: duplicate card %s for %s in '%s'", short_name(cs), player2str(player), str);
-            return false;
-        }
-        //dprintf("deal: player=%d, i=%d, suit=%d, card=%d, cs=%d", player, i, suit, card, cs);
-        if (card > HANDSIZE) {
-            dprintf("deal: too many cards for %s in '%s'", player2str(player), str);
+        } else if (k == DEAL_CH_HAND) {
+            player = (player + 1) % NPLAYERS;
+            suit = 3;
+        } else if (k < DEAL_CH_SUIT + NSUITS) {
+            suit = k - DEAL_CH_SUIT;
+        } else {
+            dprintf("deal: invalid card '%c' in '%s'", *p, str);
             return false;
         }
-        //dprintf("deal: assign %s to %s", short_name(cs), player2str(player));
-        cards[player][card++] = cs;
-        owner[cs] = player;
     }
 
-    // radomize remaining cards.
-    for (int p = 0 ; p < NPLAYERS ; p++) {
-        for (int c = 0 ; c < HANDSIZE ; c++) {
-            if (cards[p][c] == CARD_NULL) {
-                int off = esp_random() % DECKLEN;
-                for (int i = 0 ; i < DECKLEN ; i++) {
-                    int cs = (off + i) % DECKLEN;
-                    if (owner[cs] == CARD_NULL) {
-                        //dprintf("deal: random assign %s to %s", short_name(cs), player2str(p));
-                        cards[p][c] = cs;
-                        owner[cs] = p;
-                        break;
-                    }
-                }
-            }
+    // shuffle the remaining cards (Fisher-Yates) and hand them out
+    unsigned char rest[DECKLEN];
+    int n = 0;
+    for (int cs = 0 ; cs < DECKLEN ; cs++) {
+        rest[n] = cs;
+        n += owner[cs] == CARD_NULL;
+    }
+    for (int i = n - 1 ; i > 0 ; i--) {
+        int j = deal_random(i + 1);
+        unsigned char t = rest[i];
+        rest[i] = rest[j];
+        rest[j] = t;
+    }
+    for (int player = 0, i = 0 ; player < NPLAYERS ; player++) {
+        for (; count[player] < HANDSIZE ; count[player]++) {
+            owner[rest[i++]] = player;
         }
     }
-    for (int p = 0 ; p < NPLAYERS ; p++) {
-        std::sort(&cards[p][0], &cards[p][HANDSIZE]);
+
+    // hands in card order
+    for (int player = 0 ; player < NPLAYERS ; player++) {
+        count[player] = 0;
+    }
+    for (int cs = 0 ; cs < DECKLEN ; cs++) {
+        int player = owner[cs];
+        cards[player][count[player]++] = cs;
     }
     return true;
 }
 
+// PBN deal, starting with the dealer, buf must hold DEAL_TEXTLEN
+int Deal::format(char *buf) const
+{
+    char *p = buf;
+    *p++ = "NESW"[dealer];
+    *p++ = ':';
+    for (int i = 0 ; i < NPLAYERS ; i++) {
+        const unsigned char *hand = cards[(dealer + i) % NPLAYERS];
+        int j = HANDSIZE - 1;
+        for (int suit = NSUITS - 1 ; suit >= 0 ; suit--) {
+            for (; j >= 0 && SUIT(hand[j]) == suit ; j--) {
+                *p++ = "23456789TJQKA"[CARD(hand[j])];
+            }
+            *p++ = '.';
+        }
+        p[-1] = ' ';
+    }
+    p[-1] = '\0';
+    return p - 1 - buf;
+}
+
 void Deal::debug()
 {
+    Bitboard bits(*this);
     for (int i = 0 ; i < NPLAYERS ; i++) {
-        int hcp = 0;
         char buf[128];
         int n =  snprintf(buf, sizeof(buf), "%c:", player2ch(i));
         for (int j = 0 ; j < HANDSIZE ; j++) {
             n += snprintf(buf + n, sizeof(buf) - n, " %s", short_name(cards[i][j]));
-            hcp += card2hcp(cards[i][j]);
         }
-        dprintf("%s - %2d", buf, hcp);
+        Hand h = bits.hands[i];
+        dprintf("%s - %2d hcp, %04x, ltc %d", buf, hand_hcp(h), hand_shape(h), hand_ltc(h));
+    }
+    DealId id;
+    if (id.encode(bits)) {
+        char buf[DEAL_ID_TEXTLEN];
+        id.format(buf);
+        dprintf("deal: id %s", buf);
+    }
+}
+
+//
+// Bitboard
+//
+
+void Bitboard::from(const Deal &deal)
+{
+    dealer = deal.dealer;
+    for (int p = 0 ; p < NPLAYERS ; p++) {
+        Hand h = 0;
+        for (int c = 0 ; c < HANDSIZE ; c++) {
+            h |= HAND_BIT(deal.cards[p][c]);
+        }
+        hands[p] = h;
+    }
+}
+
+// false, and the deal is left alone, unless the board is valid
+bool Bitboard::to(Deal &deal) const
+{
+    if (!valid()) {
+        return false;
+    }
+    deal.dealer = dealer;
+    for (int p = 0 ; p < NPLAYERS ; p++) {
+        int n = 0;
+        for (int cs = 0 ; cs < DECKLEN ; cs++) {
+            if (hands[p] & HAND_BIT(cs)) {
+                deal.cards[p][n++] = cs;
+                deal.owner[cs] = p;
+            }
+        }
+    }
+    return true;
+}
+
+// every card dealt once, 13 cards each
+bool Bitboard::valid() const
+{
+    Hand all = hands[0] | hands[1] | hands[2] | hands[3];
+    return hand_count(all) == DECKLEN && hand_count(hands[0]) == HANDSIZE &&
+           hand_count(hands[1]) == HANDSIZE && hand_count(hands[2]) == HANDSIZE &&
+           hand_count(hands[3]) == HANDSIZE;
+}
+
+// suit lengths, one per nibble, spades in the high nibble (0x5332)
+int hand_shape(Hand h)
+{
+    return (hand_length(h, 3) << 12) | (hand_length(h, 2) << 8) | (hand_length(h, 1) << 4) | hand_length(h, 0);
+}
+
+// losing trick count, per suit the top three cards (fewer when short)
+// less the ace, king (with length 2+) and queen (with length 3+).
+int hand_ltc(Hand h)
+{
+    int ltc = 0;
+    for (int s = 0 ; s < NSUITS ; s++) {
+        Hand suit = h >> (s * HAND_LANE);
+        int len = hand_count(suit & 0x1FFF);
+        ltc += min(len, 3) - (int)((suit >> 12) & 1) - (int)((suit >> 11) & (len >= 2)) - (int)((suit >> 10) & (len >= 3));
+    }
+    return ltc;
+}
+//
+// DealId
+//
+
+#define DEAL_ID_DIGITS      6           // 16 bit digits in 96 bits
+
+static struct Binomial {
+    uint64_t c[DECKLEN + 1][HANDSIZE + 1];
+
+    Binomial() {
+        for (int n = 0 ; n <= DECKLEN ; n++) {
+            c[n][0] = 1;
+            for (int k = 1 ; k <= HANDSIZE ; k++) {
+                c[n][k] = n == 0 ? 0 : c[n-1][k-1] + c[n-1][k];
+            }
+        }
+    }
+} binomial;
+
+static inline int id_digit(const DealId &x, int i)
+{
+    return (x.w[i / 2] >> (16 * (i % 2))) & 0xFFFF;
+}
+
+static inline void id_set_digit(DealId &x, int i, uint32_t d)
+{
+    int shift = 16 * (i % 2);
+    x.w[i / 2] = (x.w[i / 2] & ~(0xFFFF << shift)) | (d << shift);
+}
+
+// x = x * m + a, m and a below 2^40, false on overflow
+static bool id_mul_add(DealId &x, uint64_t m, uint64_t a)
+{
+    uint64_t carry = a;
+    for (int i = 0 ; i < DEAL_ID_DIGITS ; i++) {
+        uint64_t lo = id_digit(x, i) * (m & 0xFFFFFF) + (carry & 0xFFFFFF);
+        uint64_t hi = id_digit(x, i) * (m >> 24) + (carry >> 24);
+        // digit * m + carry = lo + hi * 2^24
+        carry = (lo >> 16) + (hi << 8);
+        id_set_digit(x, i, (lo & 0xFFFF));
+    }
+    return carry == 0;
+}
+
+// x = x / d, returns x % d, d below 2^40
+static uint64_t id_div_mod(DealId &x, uint64_t d)
+{
+    uint64_t rem = 0;
+    for (int i = DEAL_ID_DIGITS - 1 ; i >= 0 ; i--) {
+        uint64_t v = (rem << 16) | id_digit(x, i);
+        id_set_digit(x, i, v / d);
+        rem = v % d;
+    }
+    return rem;
+}
+
+const DealId &DealId::count()
+{
+    static DealId total;
+    if (total.w[0] == 0 && total.w[1] == 0) {
+        total = DealId(binomial.c[52][13]);
+        id_mul_add(total, binomial.c[39][13], 0);
+        id_mul_add(total, binomial.c[26][13], 0);
+    }
+    return total;
+}
+
+bool DealId::operator<(const DealId &o) const
+{
+    for (int i = 2 ; i >= 0 ; i--) {
+        if (w[i] != o.w[i]) {
+            return w[i] < o.w[i];
+        }
     }
-}
\ No newline at end of file
+    return false;
+}
+
+bool DealId::valid() const
+{
+    return *this < count();
+}
+
+bool DealId::encode(const Bitboard &bits)
+{
+    if (!bits.valid()) {
+        return false;
+    }
+    *this = DealId();
+    Hand used = 0;
+    for (int p = 0 ; p < NPLAYERS - 1 ; p++) {
+        // rank the hand among the cards that are left
+        uint64_t rank = 0;
+        for (int cs = 0, j = 0, k = 0 ; cs < DECKLEN ; cs++) {
+            Hand bit = HAND_BIT(cs);
+            if (used & bit) {
+                continue;
+            }
+            if (bits.hands[p] & bit) {
+                rank += binomial.c[j][++k];
+            }
+            j++;
+        }
+        used |= bits.hands[p];
+        id_mul_add(*this, p == 0 ? 1 : binomial.c[DECKLEN - p * HANDSIZE][HANDSIZE], rank);
+    }
+    return true;
+}
+
+bool DealId::decode(Bitboard &bits) const
+{
+    if (!valid()) {
+        return false;
+    }
+    DealId x = *this;
+    uint64_t rank[NPLAYERS - 1];
+    rank[2] = id_div_mod(x, binomial.c[26][13]);
+    rank[1] = id_div_mod(x, binomial.c[39][13]);
+    rank[0] = ((uint64_t)x.w[1] << 32) | x.w[0];
+
+    unsigned char rest[DECKLEN];
+    for (int cs = 0 ; cs < DECKLEN ; cs++) {
+        rest[cs] = cs;
+    }
+    for (int p = 0, n = DECKLEN ; p < NPLAYERS ; p++) {
+        Hand h = 0;
+        if (p == NPLAYERS - 1) {
+            for (int j = 0 ; j < n ; j++) {
+                h |= HAND_BIT(rest[j]);
+            }
+        } else {
+            // greedy unrank, the largest position first
+            uint64_t r = rank[p];
+            int j = n;
+            for (int k = HANDSIZE ; k > 0 ; k--) {
+                while (binomial.c[--j][k] > r) {
+                }
+                r -= binomial.c[j][k];
+                h |= HAND_BIT(rest[j]);
+            }
+            // keep the cards that are left, in order
+            int m = 0;
+            for (int j = 0 ; j < n ; j++) {
+                if (!(h & HAND_BIT(rest[j]))) {
+                    rest[m++] = rest[j];
+                }
+            }
+            n = m;
+        }
+        bits.hands[p] = h;
+    }
+    return true;
+}
+
+// decimal, or hex with 0x
+bool DealId::parse(const char *str)
+{
+    *this = DealId();
+    int base = 10;
+    if (str[0] == '0' && (str[1] == 'x' || str[1] == 'X')) {
+        base = 16;
+        str += 2;
+    }
+    if (*str == '\0') {
+        return false;
+    }
+    for (; *str != '\0' ; str++) {
+        int d = *str >= '0' && *str <= '9' ? *str - '0' :
+                *str >= 'a' && *str <= 'f' ? *str - 'a' + 10 :
+                *str >= 'A' && *str <= 'F' ? *str - 'A' + 10 : 99;
+        if (d >= base || !id_mul_add(*this, base, d)) {
+            return false;
+        }
+    }
+    return valid();
+}
+
+// decimal, buf must hold DEAL_ID_TEXTLEN
+int DealId::format(char *buf) const
+{
+    char tmp[DEAL_ID_TEXTLEN];
+    int n = 0;
+    DealId x = *this;
+    do {
+        tmp[n++] = '0' + id_div_mod(x, 10);
+    } while (x.w[0] != 0 || x.w[1] != 0 || x.w[2] != 0);
+    for (int i = 0 ; i < n ; i++) {
+        buf[i] = tmp[n - 1 - i];
+    }
+    buf[n] = '\0';
+    return n;
+}
+
+// uniform over all deals
+void DealId::random()
+{
+    do {
+        w[0] = esp_random();
+        w[1] = esp_random();
+        w[2] = esp_random();
+    } while (!valid());
+}
+
+//
+// DealReader
+//
+
+void DealReader::reset()
+{
+    format = DEAL_FORMAT_UNKNOWN;
+    board = 0;
+    dealer = -1;
+    deals = 0;
+    errors = 0;
+    stopped = false;
+    pending[0] = 0;
+    toklen = 0;
+    overflow = false;
+    comment = false;
+    value = false;
+}
+
+void DealReader::emit(const char *str)
+{
+    Deal deal;
+    strncpy(text, str, sizeof(text) - 1);
+    text[sizeof(text) - 1] = 0;
+    if (!deal.parse(text)) {
+        errors++;
+        return;
+    }
+    // the prefix of a deal is the first hand, the dealer is separate
+    if (dealer >= 0) {
+        deal.dealer = dealer;
+    }
+    deals++;
+    if (!handler(*this, deal, arg)) {
+        stopped = true;
+    }
+}
+
+// a complete line, for deal lists and PBN
+void DealReader::line()
+{
+    char *p = tok;
+    while (*p == ' ' || *p == '\t') {
+        p++;
+    }
+    if (*p == 0 || *p == '%' || *p == ';' || *p == '#') {
+        return;
+    }
+    if (*p != '[') {
+        if (format == DEAL_FORMAT_UNKNOWN) {
+            format = DEAL_FORMAT_LINES;
+        }
+        if (format == DEAL_FORMAT_LINES) {
+            board++;
+            emit(p);
+        }
+        // other PBN lines (auction, play) are ignored
+        return;
+    }
+    format = DEAL_FORMAT_PBN;
+    // [Tag "Value"]
+    char *name = p + 1;
+    char *q = strchr(name, ' ');
+    char *v = q ? strchr(q, '"') : NULL;
+    char *e = v ? strchr(v + 1, '"') : NULL;
+    if (e == NULL) {
+        return;
+    }
+    *q = 0;
+    *e = 0;
+    v += 1;
+    if (strcmp(name, "Board") == 0) {
+        board = atoi(v);
+        dealer = -1;
+    } else if (strcmp(name, "Dealer") == 0) {
+        dealer = ch2player(v[0]);
+    } else if (strcmp(name, "Deal") == 0) {
+        emit(v);
+    }
+}
+
+// a LIN key|value| pair, md| is dealer digit (1=S, 2=W, 3=N, 4=E), then 
+// the hands clockwise starting with South, the last may be left out.
+// The ah| board number follows md|, so the deal is held until then.
+void DealReader::pair()
+{
+    if (strcmp(key, "ah") == 0) {
+        const char *p = strpbrk(tok, "0123456789");
+        if (p != NULL) {
+            board = atoi(p);
+        }
+        flush();
+    } else if (strcmp(key, "md") == 0 && toklen > 0) {
+        flush();
+        static const int lin_dealer[] = {SOUTH, WEST, NORTH, EAST};
+        int d = tok[0] - '1';
+        dealer = d >= 0 && d < 4 ? lin_dealer[d] : -1;
+        snprintf(pending, sizeof(pending), "S:%s", d >= 0 && d < 4 ? tok + 1 : tok);
+        board = 0;
+    }
+}
+
+// emit the held LIN deal, if any
+void DealReader::flush()
+{
+    if (pending[0] != 0) {
+        if (board == 0) {
+            board = deals + errors + 1;
+        }
+        emit(pending);
+        pending[0] = 0;
+    }
+}
+
+void DealReader::feed(const char *buf, int len)
+{
+    for (int i = 0 ; i < len && !stopped ; i++) {
+        char c = buf[i];
+        if (format == DEAL_FORMAT_LIN) {
+            if (c == '\n' || c == '\r') {
+                continue;
+            }
+            if (c != '|') {
+                if (toklen < (int)sizeof(tok) - 1) {
+                    tok[toklen++] = c;
+                }
+                continue;
+            }
+            tok[toklen] = 0;
+            if (value) {
+                pair();
+            } else {
+                strncpy(key, tok, sizeof(key) - 1);
+                key[sizeof(key) - 1] = 0;
+            }
+            value = !value;
+            toklen = 0;
+            continue;
+        }
+        if (comment) {
+            comment = c != '}';
+            continue;
+        }
+        if (c == '{' && toklen == 0) {
+            comment = true;
+            continue;
+        }
+        if (c == '|' && format == DEAL_FORMAT_UNKNOWN && toklen == 2) {
+            // looks like LIN, the token so far is the first key
+            format = DEAL_FORMAT_LIN;
+            tok[toklen] = 0;
+            strcpy(key, tok);
+            value = true;
+            toklen = 0;
+            continue;
+        }
+        if (c == '\n') {
+            tok[toklen] = 0;
+            if (toklen > 0 && tok[toklen-1] == '\r') {
+                tok[toklen-1] = 0;
+            }
+            if (!overflow) {
+                line();
+            }
+            toklen = 0;
+            overflow = false;
+            continue;
+        }
+        if (toklen < (int)sizeof(tok) - 1) {
+            tok[toklen++] = c;
+        } else {
+            overflow = true;
+        }
+    }
+}
+
+// end of input, handle the last line
+void DealReader::finish()
+{
+    if (format != DEAL_FORMAT_LIN && toklen > 0 && !stopped) {
+        feed("\n", 1);
+    }
+    if (!stopped) {
+        flush();
+    }
+}
+
+// read a whole stream with a fixed buffer, returns the number of deals
+unsigned long DealReader::read(Stream &in)
+{
+    char buf[DEAL_READER_BUFLEN];
+    for (int n ; !stopped && (n = in.readBytes(buf, sizeof(buf))) > 0 ;) {
+        feed(buf, n);
+    }
+    finish();
+    return deals;
+}
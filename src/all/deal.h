@@ -8,6 +8,7 @@
 #define NSUITS              4
 #define SUITLEN             (DECKLEN / NSUITS)
 #define HANDSIZE            (DECKLEN / NPLAYERS)
+#define DEAL_TEXTLEN        (2 + DECKLEN + NPLAYERS * NSUITS)  // N:...
 
 enum {NORTH, EAST, SOUTH, WEST};
 
@@ -18,9 +19,138 @@ class Deal {
     unsigned char owner[DECKLEN];
   public:
     bool parse(const char *str);
+    int format(char *buf) const;
     void debug();
 };
 
+//
+// Compact deal, one 64 bit mask per hand, 16 bits per suit with clubs
+// in the low bits, and bit n for rank n (2 = 0 .. A = 12). Hand
+// evaluation is done with masks and popcount.
+//
+typedef uint64_t Hand;
+
+#define HAND_LANE           16
+#define HAND_SUIT(s)        (0x1FFFULL << ((s) * HAND_LANE))
+#define HAND_RANK(r)        (0x0001000100010001ULL << (r))
+#define HAND_BIT(cs)        (1ULL << (SUIT(cs) * HAND_LANE + CARD(cs)))
+
+class Bitboard {
+  public:
+    int dealer = NORTH;
+    Hand hands[NPLAYERS] = {0, 0, 0, 0};
+  public:
+    Bitboard() {}
+    Bitboard(const Deal &deal) { from(deal); }
+    void from(const Deal &deal);
+    bool to(Deal &deal) const;
+    bool valid() const;
+};
+
+inline int hand_count(Hand h)
+{
+    return __builtin_popcountll(h);
+}
+
+inline int hand_length(Hand h, int suit)
+{
+    return hand_count(h & HAND_SUIT(suit));
+}
+
+// A=4, K=3, Q=2, J=1
+inline int hand_hcp(Hand h)
+{
+    return 4 * hand_count(h & HAND_RANK(12)) + 3 * hand_count(h & HAND_RANK(11)) +
+           2 * hand_count(h & HAND_RANK(10)) + hand_count(h & HAND_RANK(9));
+}
+
+// A=2, K=1
+inline int hand_controls(Hand h)
+{
+    return 2 * hand_count(h & HAND_RANK(12)) + hand_count(h & HAND_RANK(11));
+}
+
+extern int hand_shape(Hand h);
+extern int hand_ltc(Hand h);
+
+//
+// The index of a deal among all C(52,13)·C(39,13)·C(26,13) deals, about
+// 5.36e28, which fits in 96 bits. North's hand is ranked among the 52
+// cards, East's among the 39 left and South's among the 26 left, using
+// the combinatorial number system. The dealer is not part of the index.
+//
+#define DEAL_ID_TEXTLEN     32          // decimal digits
+
+class DealId {
+  public:
+    uint32_t w[3] = {0, 0, 0};      // little endian
+  public:
+    DealId() {}
+    DealId(uint64_t n) { w[0] = (uint32_t)n; w[1] = (uint32_t)(n >> 32); }
+    bool encode(const Bitboard &bits);
+    bool decode(Bitboard &bits) const;
+    bool parse(const char *str);
+    int format(char *buf) const;
+    void random();
+    bool valid() const;
+    bool operator==(const DealId &o) const { return w[0] == o.w[0] && w[1] == o.w[1] && w[2] == o.w[2]; }
+    bool operator<(const DealId &o) const;
+    static const DealId &count();
+};
+
+//
+// Streaming reader for deal lists, PBN files ([Board], [Dealer] and [Deal]
+// tags) and BBO LIN files (ah| and md| records). Input is fed in chunks 
+// of any size, nothing is buffered beyond a single line or LIN value.
+// Each deal is passed to the handler with the reader, for the board
+// number, the dealer, and the text of the deal.
+//
+#define DEAL_READER_TOKLEN  128
+#define DEAL_READER_BUFLEN  256
+
+enum DealFormat {
+    DEAL_FORMAT_UNKNOWN,
+    DEAL_FORMAT_LINES,              // one deal per line, see Deal::parse
+    DEAL_FORMAT_PBN,
+    DEAL_FORMAT_LIN,
+};
+
+class DealReader {
+  public:
+    typedef bool (*Handler)(DealReader &reader, Deal &deal, void *arg);
+    Handler handler;
+    void *arg;
+    int format = DEAL_FORMAT_UNKNOWN;
+    int board = 0;                  // board number of the current deal
+    int dealer = -1;                // dealer of the current deal, if known
+    char text[DEAL_READER_TOKLEN + 2]; // the current deal, in Deal::parse format
+    unsigned long deals = 0;
+    unsigned long errors = 0;
+    bool stopped = false;           // the handler returned false
+
+  private:
+    char tok[DEAL_READER_TOKLEN];
+    char key[4];
+    char pending[DEAL_READER_TOKLEN + 2]; // LIN deal waiting for its board number, "S:" and a token
+    int toklen = 0;
+    bool overflow = false;
+    bool comment = false;           // inside a PBN { } comment
+    bool value = false;             // LIN, reading the value of a key
+
+  public:
+    DealReader(Handler handler, void *arg = NULL) : handler(handler), arg(arg) { pending[0] = 0; }
+    void reset();
+    void feed(const char *buf, int len);
+    void finish();
+    unsigned long read(Stream &in);
+
+  private:
+    void line();
+    void pair();
+    void flush();
+    void emit(const char *str);
+};
+
 extern const char *short_name(int cs);
 extern const char *full_name(int cs);
 extern char card2ch(int c);
@@ -32,3 +162,4 @@ extern char player2ch(int p);
 extern const char *player2str(int p);
 extern int ch2player(char c);
 extern int card2hcp(int c);
+extern uint32_t deal_random(uint32_t n);
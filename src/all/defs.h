@@ -39,11 +39,17 @@
 //
 
 #define CAMERA_ADDR         0x1A
+#define AS5600_ADDR         0x36     // angle sensor
 #define CMD_CAPTURE         0xFE
 #define CMD_COLLATE         0xFD
 #define CMD_IDENTIFY        0xFC
 #define CMD_CLEAR           0xFB
 #define CMD_STATUS          0xFA
+#define CMD_HELLO           0xF9     // protocol negotiation, see bus.h
+#define CMD_INFO            0xF8     // device role and capabilities, see bus.h
+#define CMD_RESTORE         0xF7     // learn, card count, previous card, to resume a deal
+#define CMD_TIME            0xF6     // clock sync, responds with micros(), see trace.h
+#define CMD_SPANS           0xF5     // read trace spans, see trace.h
 
 #define CARD_NULL           255      // no card detected yet
 #define CARD_EMPTY          254      // no card detected in hopper
@@ -0,0 +1,245 @@
+// (c)2024, Arthur van Hoff, Artfahrt Inc.
+#include "generate.h"
+
+//
+// SeatConstraint
+//
+
+void SeatConstraint::clear()
+{
+    hcp_min = 0;
+    hcp_max = 37;
+    for (int s = 0 ; s < NSUITS ; s++) {
+        len_min[s] = 0;
+        len_max[s] = HANDSIZE;
+    }
+    balanced = -1;
+    fixed = 0;
+}
+
+bool SeatConstraint::any() const
+{
+    bool any = hcp_min > 0 || hcp_max < 37 || balanced >= 0 || fixed != 0;
+    for (int s = 0 ; s < NSUITS ; s++) {
+        any |= len_min[s] > 0 || len_max[s] < HANDSIZE;
+    }
+    return any;
+}
+
+bool SeatConstraint::match(Hand h) const
+{
+    int hcp = hand_hcp(h);
+    bool ok = hcp >= hcp_min && hcp <= hcp_max;
+    for (int s = 0 ; s < NSUITS ; s++) {
+        int len = hand_length(h, s);
+        ok &= len >= len_min[s] && len <= len_max[s];
+    }
+    return ok && (balanced < 0 || hand_balanced(h) == balanced);
+}
+
+// no void or singleton, at most one doubleton
+bool hand_balanced(Hand h)
+{
+    int shortest = HANDSIZE, doubletons = 0;
+    for (int s = 0 ; s < NSUITS ; s++) {
+        int len = hand_length(h, s);
+        shortest = min(shortest, len);
+        doubletons += len == 2;
+    }
+    return shortest >= 2 && doubletons <= 1;
+}
+
+//
+// DealConstraint
+//
+
+void DealConstraint::clear()
+{
+    for (int p = 0 ; p < NPLAYERS ; p++) {
+        seats[p].clear();
+        order[p] = p;
+    }
+    fixed = 0;
+}
+
+// a number, or -1 if there is none
+static int parse_number(const char *&p)
+{
+    if (*p < '0' || *p > '9') {
+        return -1;
+    }
+    int n = 0;
+    while (*p >= '0' && *p <= '9') {
+        n = n * 10 + *p++ - '0';
+    }
+    return n;
+}
+
+bool DealConstraint::parse(const char *str)
+{
+    clear();
+    const char *p = str;
+    while (*p != '\0') {
+        if (*p == ' ' || *p == ';') {
+            p++;
+            continue;
+        }
+        int player = ch2player(*p);
+        if (player < 0 || p[1] != ':') {
+            dprintf("generate: expected seat in '%s'", str);
+            return false;
+        }
+        SeatConstraint &seat = seats[player];
+        for (p += 2 ; *p != '\0' && *p != ' ' && *p != ';' ;) {
+            if (*p == ',') {
+                p++;
+            } else if (strncmp(p, "bal", 3) == 0) {
+                seat.balanced = 1;
+                p += 3;
+            } else if (strncmp(p, "unbal", 5) == 0) {
+                seat.balanced = 0;
+                p += 5;
+            } else if (*p == '=') {
+                // fixed cards
+                int suit = 3;
+                for (p++ ; *p != '\0' && *p != ',' && *p != ' ' && *p != ';' ; p++) {
+                    if (*p == '.') {
+                        suit = max(suit - 1, 0);
+                        continue;
+                    }
+                    int c = ch2card(*p);
+                    if (c == CARD_NULL) {
+                        dprintf("generate: invalid card '%c' in '%s'", *p, str);
+                        return false;
+                    }
+                    Hand bit = HAND_BIT(CARDSUIT(suit, c));
+                    if (fixed & bit) {
+                        dprintf("generate: duplicate card %s in '%s'", short_name(CARDSUIT(suit, c)), str);
+                        return false;
+                    }
+                    seat.fixed |= bit;
+                    fixed |= bit;
+                }
+                if (hand_count(seat.fixed) > HANDSIZE) {
+                    dprintf("generate: too many cards for %s in '%s'", player2str(player), str);
+                    return false;
+                }
+            } else {
+                // lo-hi, lo+, lo or -hi, followed by a suit for a length
+                int lo = parse_number(p);
+                int hi = lo;
+                if (*p == '+') {
+                    hi = 99;
+                    p++;
+                } else if (*p == '-') {
+                    p++;
+                    hi = parse_number(p);
+                    lo = max(lo, 0);
+                }
+                int suit = ch2suit(*p);
+                if (lo < 0 || hi < 0) {
+                    dprintf("generate: invalid term in '%s'", str);
+                    return false;
+                }
+                if (suit >= 0) {
+                    seat.len_min[suit] = min(lo, HANDSIZE);
+                    seat.len_max[suit] = min(hi, HANDSIZE);
+                    p++;
+                } else {
+                    seat.hcp_min = min(lo, 37);
+                    seat.hcp_max = min(hi, 37);
+                }
+            }
+        }
+    }
+    // draw the constrained seats first, so misses are rejected early
+    std::stable_sort(order, order + NPLAYERS, [this](int a, int b) {
+        return seats[a].any() > seats[b].any();
+    });
+    return true;
+}
+
+bool DealConstraint::match(const Bitboard &bits) const
+{
+    bool ok = true;
+    for (int p = 0 ; p < NPLAYERS ; p++) {
+        ok &= seats[p].match(bits.hands[p]);
+    }
+    return ok;
+}
+
+//
+// DealGenerator
+//
+
+// splitmix64, the state is a counter
+static inline uint64_t gen_next(uint64_t &state)
+{
+    uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+// unbiased 0..n-1 (Lemire)
+static inline uint32_t gen_random(uint64_t &state, uint32_t n)
+{
+    for (;;) {
+        uint64_t m = (gen_next(state) >> 32) * n;
+        uint32_t l = (uint32_t)m;
+        if (l >= n || l >= (uint32_t)(-n) % n) {
+            return m >> 32;
+        }
+    }
+}
+
+bool DealGenerator::generate(uint64_t index, Bitboard &bits, unsigned long max_tries)
+{
+    start(index);
+    return next(bits, max_tries, max_tries) == GEN_FOUND;
+}
+
+// start on deal index of the seed
+void DealGenerator::start(uint64_t index)
+{
+    state = seed ^ (index * 0xD1B54A32D192ED03ULL);
+    nrest = 0;
+    for (int cs = 0 ; cs < DECKLEN ; cs++) {
+        rest[nrest] = cs;
+        nrest += (constraint.fixed & HAND_BIT(cs)) == 0;
+    }
+    attempts = 0;
+}
+
+// up to n more tries at the deal, the result is the same however the tries are split
+int DealGenerator::next(Bitboard &bits, unsigned long n, unsigned long max_tries)
+{
+    for (unsigned long t = 0 ; t < n && attempts < max_tries ; t++) {
+        attempts++;
+        tries++;
+        bool ok = true;
+        // partial Fisher-Yates, draw each seat from the end of the pool
+        for (int i = 0, left = nrest ; i < NPLAYERS && ok ; i++) {
+            int p = constraint.order[i];
+            Hand h = constraint.seats[p].fixed;
+            for (int k = hand_count(h) ; k < HANDSIZE ; k++) {
+                int j = gen_random(state, left--);
+                unsigned char cs = rest[j];
+                rest[j] = rest[left];
+                rest[left] = cs;
+                h |= HAND_BIT(cs);
+            }
+            bits.hands[p] = h;
+            ok = constraint.seats[p].match(h);
+        }
+        if (ok) {
+            found++;
+            return GEN_FOUND;
+        }
+    }
+    if (attempts < max_tries) {
+        return GEN_MORE;
+    }
+    dprintf("generate: no deal found after %lu tries", max_tries);
+    return GEN_FAILED;
+}
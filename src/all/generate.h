@@ -0,0 +1,80 @@
+// (c)2024, Arthur van Hoff, Artfahrt Inc.
+#pragma once
+#include "util.h"
+#include "deal.h"
+
+#define GEN_MAX_TRIES       50000       // deals tried before giving up
+#define GEN_STEP_TRIES      500         // deals tried per call of next(), keeps the idle loop going
+
+enum GenResult {
+    GEN_FOUND,
+    GEN_MORE,                       // not found yet, call next() again
+    GEN_FAILED,                     // not found in max_tries
+};
+
+//
+// Constraints on a deal, one group per seat separated by spaces or ';'
+// and terms separated by ','. For example:
+//
+//   N:15-17,bal S:5+S,8-10 W:=AKQ...
+//
+//   15-17, 12+, -9     high card points
+//   5S, 5+H, 4-5D, -1C suit length
+//   bal, unbal         4333, 4432 or 5332 shape, or not
+//   =AKQ.JT..2         fixed cards, spades first as in Deal::parse
+//
+struct SeatConstraint {
+    uint8_t hcp_min;
+    uint8_t hcp_max;
+    uint8_t len_min[NSUITS];
+    uint8_t len_max[NSUITS];
+    int8_t balanced;                // -1 any, 0 unbalanced, 1 balanced
+    Hand fixed;
+
+    void clear();
+    bool any() const;
+    bool match(Hand h) const;
+};
+
+class DealConstraint {
+  public:
+    SeatConstraint seats[NPLAYERS];
+    Hand fixed;                     // all fixed cards
+    int order[NPLAYERS];            // constrained seats first
+
+  public:
+    DealConstraint() { clear(); }
+    void clear();
+    bool parse(const char *str);
+    bool match(const Bitboard &bits) const;
+};
+
+extern bool hand_balanced(Hand h);
+
+//
+// Random deals that match a constraint. Deal i of a seed is always
+// the same (counter-based), so a set can be split over threads or
+// regenerated from (seed, index). Seats are filled one at a time from
+// the cards that are not fixed, and a seat that fails rejects the deal
+// before the other seats are drawn. A hard constraint can take many
+// tries, start() and next() spread them over several idle steps.
+//
+class DealGenerator {
+  public:
+    DealConstraint constraint;
+    uint64_t seed;
+    unsigned long tries = 0;
+    unsigned long found = 0;
+
+  private:
+    uint64_t state = 0;             // of the deal being generated
+    unsigned char rest[DECKLEN];    // cards that are not fixed
+    int nrest = 0;
+    unsigned long attempts = 0;     // for this deal
+
+  public:
+    DealGenerator(uint64_t seed = 0) : seed(seed) {}
+    bool generate(uint64_t index, Bitboard &bits, unsigned long max_tries = GEN_MAX_TRIES);
+    void start(uint64_t index);
+    int next(Bitboard &bits, unsigned long n = GEN_STEP_TRIES, unsigned long max_tries = GEN_MAX_TRIES);
+};
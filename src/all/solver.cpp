@@ -0,0 +1,496 @@
+// (c)2024, Arthur van Hoff, Artfahrt Inc.
+#include "solver.h"
+#ifdef ARDUINO
+#include <esp_heap_caps.h>
+#endif
+
+#define DD_BIT_SUIT(b)      ((b) / HAND_LANE)
+
+char strain2ch(int strain)
+{
+    return (strain < 0 || strain >= DD_STRAINS) ? '?' : "CDHSN"[strain];
+}
+
+//
+// DDTable
+//
+
+bool DDTable::solved() const
+{
+    for (int s = 0 ; s < DD_STRAINS ; s++) {
+        for (int p = 0 ; p < NPLAYERS ; p++) {
+            if (tricks[s][p] < 0) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// one line per declarer, strains in NT S H D C order
+int DDTable::print(char *buf, int len) const
+{
+    int n = snprintf(buf, len, "    NT  S  H  D  C\n");
+    for (int p = 0 ; p < NPLAYERS && n < len ; p++) {
+        n += snprintf(buf + n, len - n, "%c: %3d%3d%3d%3d%3d\n", player2ch(p),
+                      tricks[4][p], tricks[3][p], tricks[2][p], tricks[1][p], tricks[0][p]);
+    }
+    return n;
+}
+
+//
+// DDSolver
+//
+
+DDSolver::DDSolver()
+{
+#ifdef DD_TT_PSRAM_BITS
+    // the internal table is far too small for a full board
+    tt_size = 1UL << DD_TT_PSRAM_BITS;
+    tt = (Entry *)heap_caps_calloc(tt_size, sizeof(Entry), MALLOC_CAP_SPIRAM);
+    if (tt != NULL) {
+        return;
+    }
+    dprintf("solver: no PSRAM for %lu entries", tt_size);
+#endif
+    tt_size = 1UL << DD_TT_BITS;
+    tt = (Entry *)calloc(tt_size, sizeof(Entry));
+    if (tt == NULL) {
+        dprintf("solver: failed to allocate %lu entries", tt_size);
+    }
+}
+
+DDSolver::~DDSolver()
+{
+    free(tt);
+}
+
+static inline uint64_t dd_mix(uint64_t z)
+{
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+static inline int dd_top(Hand h)
+{
+    return 63 - __builtin_clzll(h);
+}
+
+// the cards of h from bit b up
+static inline Hand dd_from(Hand h, int b)
+{
+    return h & ~((1ULL << b) - 1);
+}
+
+// card c beats card w, played earlier in the trick
+static inline bool dd_beats(int c, int w, int trump)
+{
+    return DD_BIT_SUIT(c) == DD_BIT_SUIT(w) ? c > w : DD_BIT_SUIT(c) == trump;
+}
+
+// the player that wins the trick
+int DDSolver::winner()
+{
+    int win = 0;
+    for (int i = 1 ; i < NPLAYERS ; i++) {
+        win = dd_beats(trick[i], trick[win], trump) ? i : win;
+    }
+    return (leader + win) % NPLAYERS;
+}
+
+// tricks the side on lead can cash from the top, in a suit contract no
+// more than an opponent with trumps can follow to. Either the player
+// cashes their own top cards, or leads to partner's top card and
+// partner cashes theirs.
+int DDSolver::quick_tricks(int player)
+{
+    Hand mine = hands[player];
+    Hand pard = hands[(player + 2) % NPLAYERS];
+    Hand opp1 = hands[(player + 1) % NPLAYERS];
+    Hand opp2 = hands[(player + 3) % NPLAYERS];
+    bool ruff1 = trump != DD_NOTRUMP && (opp1 & HAND_SUIT(trump)) != 0;
+    bool ruff2 = trump != DD_NOTRUMP && (opp2 & HAND_SUIT(trump)) != 0;
+    Hand live = mine | pard | opp1 | opp2;
+    int qt = 0, pqt = 0;
+    bool entry = false;
+    for (int s = 0 ; s < NSUITS ; s++) {
+        Hand l = live & HAND_SUIT(s);
+        if (l == 0) {
+            continue;
+        }
+        // the top cards, all held by the same hand, down to the first
+        // card of another hand
+        Hand owner = (mine & (1ULL << dd_top(l))) ? mine : pard;
+        Hand other = l & ~owner;
+        int top = hand_count(other != 0 ? dd_from(l & owner, dd_top(other)) : l & owner);
+        if (s != trump) {
+            top = ruff1 ? min(top, hand_length(opp1, s)) : top;
+            top = ruff2 ? min(top, hand_length(opp2, s)) : top;
+        }
+        if (owner == mine) {
+            qt += top;
+        } else if (top > 0) {
+            pqt += top;
+            entry |= (mine & HAND_SUIT(s)) != 0;
+        }
+    }
+    return entry ? max(qt, pqt) : qt;
+}
+
+// can this player, with this hand, beat card w when suit is led
+static inline bool dd_can_beat(Hand h, int suit, int w, int trump)
+{
+    Hand follow = h & HAND_SUIT(suit);
+    if (follow != 0) {
+        return DD_BIT_SUIT(w) == suit && dd_top(follow) > w;
+    }
+    Hand t = trump != DD_NOTRUMP ? h & HAND_SUIT(trump) : 0;
+    return t != 0 && (DD_BIT_SUIT(w) != trump || dd_top(t) > w);
+}
+
+// how promising a lead is, cash winners, lead toward partner's winners,
+// give partner a ruff, and don't lead into a ruff
+int DDSolver::lead_weight(int player, int c)
+{
+    int s = DD_BIT_SUIT(c);
+    Hand mine = hands[player];
+    Hand pard = hands[(player + 2) % NPLAYERS];
+    Hand lho = hands[(player + 1) % NPLAYERS];
+    Hand rho = hands[(player + 3) % NPLAYERS];
+    Hand suit = HAND_SUIT(s);
+    Hand theirs = (lho | rho) & suit;
+    int rank = c % HAND_LANE;
+    int w = 0;
+    if (trump != DD_NOTRUMP && s != trump) {
+        Hand trumps = HAND_SUIT(trump);
+        if ((lho & suit) == 0 && (lho & trumps) != 0) {
+            w -= 60;
+        }
+        if ((pard & suit) == 0 && (pard & trumps) != 0 && ((rho & suit) != 0 || (rho & trumps) == 0)) {
+            w += 50;
+        }
+    }
+    if (theirs == 0) {
+        // no trick to win from them, but a way to give the lead to partner
+        return w + ((pard & suit) != 0 ? 20 : 0) - rank;
+    }
+    int top = dd_top(theirs);
+    if (c > top) {
+        // a winner
+        return w + 60 + (trump != DD_NOTRUMP && s == trump ? 10 : 0) - rank;
+    }
+    if ((pard & suit) != 0 && dd_top(pard & suit) > top) {
+        // partner wins, lead low
+        return w + 45 - rank;
+    }
+    if (hand_count(suit & (mine | pard | lho | rho) & ~((1ULL << c) - 1) & ~mine) == 1) {
+        // only their top card is higher, force it out
+        return w + 25;
+    }
+    return w + 10 - rank;
+}
+
+// how promising a card is to follow with, or to discard
+int DDSolver::follow_weight(int player, int c, int win, bool partner)
+{
+    int s = DD_BIT_SUIT(c);
+    int led = DD_BIT_SUIT(trick[0]);
+    int w = trick[win];
+    int rank = c % HAND_LANE;
+    bool beats = dd_beats(c, w, trump);
+    bool last = played == NPLAYERS - 1;
+    Hand next = last ? 0 : hands[(player + 1) % NPLAYERS];
+    if (partner) {
+        // partner wins, unless the next player can beat it, then overtake
+        if (!last && dd_can_beat(next, led, w, trump) && beats && !dd_can_beat(next, led, c, trump)) {
+            return 60 - rank;
+        }
+        return s != led && s == trump ? -40 - rank : 40 - rank;
+    }
+    if (beats) {
+        // the cheapest card that can't be beaten by the next player,
+        // in second seat the last player is partner
+        if (last || !dd_can_beat(next, led, c, trump)) {
+            return 80 - rank;
+        }
+        return played == 1 ? 0 - rank : 20 + rank;
+    }
+    return 30 - rank;
+}
+
+// trumps in one hand of a side that are above all of the other side's,
+// each of them takes a trick
+int DDSolver::sure_trumps(int side)
+{
+    Hand t = HAND_SUIT(trump);
+    Hand theirs = (hands[side + 1] | hands[(side + 3) % NPLAYERS]) & t;
+    int top = theirs != 0 ? dd_top(theirs) : 0;
+    return max(hand_count(dd_from(hands[side] & t, top)), hand_count(dd_from(hands[side + 2] & t, top)));
+}
+
+// every suit the player can lead is won by the other side, they have
+// the top card and partner can't ruff
+bool DDSolver::loses_lead(int player)
+{
+    Hand pard = hands[(player + 2) % NPLAYERS];
+    Hand theirs = hands[(player + 1) % NPLAYERS] | hands[(player + 3) % NPLAYERS];
+    Hand live = hands[player] | pard | theirs;
+    bool ruff = trump != DD_NOTRUMP && (pard & HAND_SUIT(trump)) != 0;
+    for (int s = 0 ; s < NSUITS ; s++) {
+        Hand suit = HAND_SUIT(s);
+        if ((hands[player] & suit) == 0) {
+            continue;
+        }
+        if ((theirs & (1ULL << dd_top(live & suit))) == 0 || (ruff && s != trump && (pard & suit) == 0)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// legal cards, one per sequence, in a useful order
+int DDSolver::moves(int player, int *list, int hint)
+{
+    Hand h = hands[player];
+    if (played > 0) {
+        Hand follow = h & HAND_SUIT(DD_BIT_SUIT(trick[0]));
+        h = follow ? follow : h;
+    }
+    Hand others = hands[0] | hands[1] | hands[2] | hands[3];
+    for (int i = 0 ; i < played ; i++) {
+        others |= 1ULL << trick[i];
+    }
+    others &= ~hands[player];
+
+    // the current winner, and whether it is partner
+    int win = 0;
+    for (int i = 1 ; i < played ; i++) {
+        win = dd_beats(trick[i], trick[win], trump) ? i : win;
+    }
+    bool partner = played > 0 && (played - win) == 2;
+
+    int n = 0;
+    int weight[HANDSIZE];
+    for (int s = NSUITS - 1 ; s >= 0 ; s--) {
+        if ((h & HAND_SUIT(s)) == 0) {
+            continue;
+        }
+        // the lowest card of each sequence, so it is the cheapest
+        bool mine = false;
+        for (Hand l = (h | others) & HAND_SUIT(s) ; l != 0 ; l &= l - 1) {
+            int b = __builtin_ctzll(l);
+            bool m = (h >> b) & 1;
+            if (m && !mine) {
+                list[n++] = b;
+            }
+            mine = m;
+        }
+    }
+    // insertion sort by weight, the hint first
+    for (int i = 0 ; i < n ; i++) {
+        int c = list[i];
+        int wt = c == hint ? 1000 : played == 0 ? lead_weight(player, c) : follow_weight(player, c, win, partner);
+        int j = i;
+        for (; j > 0 && weight[j - 1] < wt ; j--) {
+            list[j] = list[j - 1];
+            weight[j] = weight[j - 1];
+        }
+        list[j] = c;
+        weight[j] = wt;
+    }
+    return n;
+}
+
+// hash of the position by relative rank, only the order of the cards
+// that are left matters, so positions that differ in the small cards
+// that were played are the same
+uint64_t DDSolver::position_key()
+{
+    Hand rel[NPLAYERS] = {0, 0, 0, 0};
+    Hand live = hands[0] | hands[1] | hands[2] | hands[3];
+    for (int s = 0 ; s < NSUITS ; s++) {
+        int k = s * HAND_LANE;
+        for (Hand l = live & HAND_SUIT(s) ; l != 0 ; l &= l - 1) {
+            Hand bit = l & -l;
+            for (int p = 0 ; p < NPLAYERS ; p++) {
+                rel[p] |= (hands[p] & bit) ? 1ULL << k : 0;
+            }
+            k++;
+        }
+    }
+    return dd_mix(rel[0] ^ dd_mix(rel[1] ^ dd_mix(rel[2] ^ dd_mix(rel[3] + leader + (trump << 2)))));
+}
+
+// card to suit and rank among the cards that are left, and back
+static int dd_relative(Hand live, int b)
+{
+    int s = DD_BIT_SUIT(b);
+    return s * HAND_LANE + hand_count(live & HAND_SUIT(s) & ((1ULL << b) - 1));
+}
+
+static int dd_absolute(Hand live, int r)
+{
+    int s = DD_BIT_SUIT(r);
+    Hand l = live & HAND_SUIT(s);
+    for (int k = r % HAND_LANE ; k > 0 && l != 0 ; k--) {
+        l &= l - 1;
+    }
+    return l != 0 ? __builtin_ctzll(l) : -1;
+}
+
+// can North-South take need of the remaining tricks, at the start of a trick
+bool DDSolver::trick_start(int need)
+{
+    int left = hand_count(hands[leader]);
+    if (need <= 0) {
+        return true;
+    }
+    if (need > left || abort) {
+        return false;
+    }
+    nodes++;
+#ifdef ARDUINO
+    if ((nodes & (DD_YIELD_NODES - 1)) == 0) {
+        vTaskDelay(1);
+    }
+#endif
+    // bounds from the quick tricks of the side on lead, a lead that
+    // always loses a trick, and the trumps each side is sure of
+    bool ns = (leader & 1) == 0;
+    int qt = quick_tricks(leader);
+    if (ns ? qt >= need : left - qt < need) {
+        return ns;
+    }
+    if ((ns ? left - 1 < need : need <= 1) && loses_lead(leader)) {
+        return !ns;
+    }
+    if (trump != DD_NOTRUMP && (sure_trumps(0) >= need || left - sure_trumps(1) < need)) {
+        return sure_trumps(0) >= need;
+    }
+
+    Entry *e = NULL;
+    uint64_t key = 0;
+    if (tt != NULL) {
+        key = position_key() | 1;
+        // two entries per bucket, the first keeps the larger positions
+        Entry *b = &tt[key & (tt_size - 2)];
+        e = b[0].key == key ? &b[0] : &b[1];
+        if (e->key == key) {
+            if (e->lower >= need) {
+                return true;
+            }
+            if (e->upper < need) {
+                return false;
+            }
+        } else {
+            if (left >= b[0].left) {
+                b[1] = b[0];
+                e = &b[0];
+            }
+            e->key = key;
+            e->lower = 0;
+            e->upper = left;
+            e->left = left;
+            e->best = -1;
+        }
+    }
+    Hand live = hands[0] | hands[1] | hands[2] | hands[3];
+    int hint = e != NULL && e->best >= 0 ? dd_absolute(live, e->best) : -1;
+    cut = -1;
+    bool r = follow(need, hint);
+    if (e != NULL && e->key == key && !abort) {
+        if (r) {
+            e->lower = max((int)e->lower, need);
+        } else {
+            e->upper = min((int)e->upper, need - 1);
+        }
+        if (r == ns && cut >= 0) {
+            e->best = dd_relative(live, cut);
+        }
+    }
+    return r;
+}
+
+// play a card for the next player in the trick
+bool DDSolver::follow(int need, int hint)
+{
+    int player = (leader + played) % NPLAYERS;
+    bool ns = (player & 1) == 0;
+    int list[HANDSIZE];
+    int n = moves(player, list, hint);
+    for (int i = 0 ; i < n ; i++) {
+        int c = list[i];
+        hands[player] &= ~(1ULL << c);
+        trick[played++] = c;
+        bool r;
+        if (played == NPLAYERS) {
+            // the next trick reuses trick[]
+            int lead = leader;
+            int saved[NPLAYERS];
+            memcpy(saved, trick, sizeof(saved));
+            leader = winner();
+            played = 0;
+            r = trick_start(need - ((leader & 1) == 0));
+            memcpy(trick, saved, sizeof(saved));
+            played = NPLAYERS;
+            leader = lead;
+        } else {
+            r = follow(need);
+        }
+        played--;
+        hands[player] |= 1ULL << c;
+        if (r == ns) {
+            if (played == 0) {
+                cut = c;
+            }
+            return r;
+        }
+    }
+    return !ns;
+}
+
+// North-South tricks with this opening leader, zero window searches
+// up or down from a guess
+int DDSolver::ns_tricks(int lead, int guess)
+{
+    int lo = 0, hi = HANDSIZE;
+    for (int need = guess ; lo < hi && !abort ;) {
+        leader = lead;
+        played = 0;
+        if (trick_start(need)) {
+            lo = need;
+            need = need + 1;
+        } else {
+            hi = need - 1;
+            need = need - 1;
+        }
+        need = max(lo + 1, min(need, hi));
+    }
+    return lo;
+}
+
+int DDSolver::tricks(const Bitboard &bits, int strain, int declarer)
+{
+    memcpy(hands, bits.hands, sizeof(hands));
+    trump = strain;
+    int ns = ns_tricks((declarer + 1) % NPLAYERS, HANDSIZE / 2);
+    return abort ? -1 : (declarer & 1) == 0 ? ns : HANDSIZE - ns;
+}
+
+bool DDSolver::solve(const Bitboard &bits, DDTable &table)
+{
+    table.clear();
+    if (!bits.valid()) {
+        return false;
+    }
+    memcpy(hands, bits.hands, sizeof(hands));
+    for (int s = 0 ; s < DD_STRAINS && !abort ; s++) {
+        trump = s;
+        for (int d = 0, ns = HANDSIZE / 2 ; d < NPLAYERS && !abort ; d++) {
+            ns = ns_tricks((d + 1) % NPLAYERS, ns);
+            table.tricks[s][d] = abort ? -1 : (d & 1) == 0 ? ns : HANDSIZE - ns;
+        }
+    }
+    return !abort;
+}
@@ -0,0 +1,83 @@
+// (c)2024, Arthur van Hoff, Artfahrt Inc.
+#pragma once
+#include "util.h"
+#include "deal.h"
+
+#define DD_STRAINS          5           // clubs, diamonds, hearts, spades, notrump
+#define DD_NOTRUMP          4
+#ifndef DD_TT_BITS
+#ifdef ARDUINO
+#define DD_TT_BITS          12          // 64KB transposition table, without PSRAM
+#define DD_TT_PSRAM_BITS    18          // 4MB in PSRAM, when there is enough
+#else
+#define DD_TT_BITS          20
+#endif
+#endif
+#define DD_YIELD_NODES      4096        // nodes between yields, a power of two
+
+//
+// Tricks taken by each declarer in each strain.
+//
+struct DDTable {
+    int8_t tricks[DD_STRAINS][NPLAYERS];
+
+    void clear() { memset(tricks, -1, sizeof(tricks)); }
+    bool solved() const;
+    int print(char *buf, int len) const;
+};
+
+extern char strain2ch(int strain);
+
+//
+// Double dummy solver. Each (strain, leader) is found by a few zero
+// window searches on the number of tricks for North-South, with
+// alpha-beta cutoffs, a transposition table of bounds at the start of
+// each trick, quick tricks and sure trump tricks for either side, a
+// bound when the leader must give up the lead, and only one card from
+// each sequence, leads and follows ordered by what they are likely to
+// win. Trump is part of the key, so the table is kept across strains
+// and boards instead of being cleared. One solver per thread. On the
+// device the solver yields every DD_YIELD_NODES nodes, so a low
+// priority task does not starve the idle task of its core.
+//
+class DDSolver {
+  public:
+    unsigned long nodes = 0;
+    volatile bool abort = false;    // set from another task to give up
+
+  private:
+    struct Entry {
+        uint64_t key;
+        int8_t lower;               // bounds on North-South tricks from here
+        int8_t upper;
+        int8_t best;                // lead that cut off, by relative rank
+        int8_t left;                // tricks left
+    };
+    Entry *tt = NULL;
+    unsigned long tt_size = 0;      // entries, a power of two
+    Hand hands[NPLAYERS];
+    int trump = DD_NOTRUMP;
+    int leader = 0;
+    int played = 0;
+    int trick[NPLAYERS];            // bit index of the cards in this trick
+    int cut = -1;                   // lead that cut off the last search
+
+  public:
+    DDSolver();
+    ~DDSolver();
+    bool solve(const Bitboard &bits, DDTable &table);
+    int tricks(const Bitboard &bits, int strain, int declarer);
+
+  private:
+    int ns_tricks(int lead, int guess);
+    bool trick_start(int need);
+    bool follow(int need, int hint = -1);
+    int moves(int player, int *list, int hint);
+    int lead_weight(int player, int c);
+    int follow_weight(int player, int c, int win, bool partner);
+    int quick_tricks(int player);
+    int sure_trumps(int side);
+    bool loses_lead(int player);
+    int winner();
+    uint64_t position_key();
+};
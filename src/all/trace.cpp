@@ -0,0 +1,171 @@
+// (c)2024, Arthur van Hoff, Artfahrt Inc.
+#include "trace.h"
+#include "webserver.h"
+
+const char *span_name(int name)
+{
+    switch (name) {
+      case SPAN_IDENTIFY: return "identify";
+      case SPAN_LOAD: return "load";
+      case SPAN_ROTATE: return "rotate";
+      case SPAN_EJECT: return "eject";
+      case SPAN_LIGHT: return "light";
+      case SPAN_FRAME: return "frame";
+      case SPAN_MATCH: return "match";
+      default: return "unknown";
+    }
+}
+
+static inline uint32_t unpack32(const unsigned char *buf)
+{
+    return buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t)buf[3] << 24);
+}
+
+static inline void pack32(unsigned char *buf, uint32_t v)
+{
+    buf[0] = v;
+    buf[1] = v >> 8;
+    buf[2] = v >> 16;
+    buf[3] = v >> 24;
+}
+
+//
+// Tracer
+//
+
+void Tracer::add(int name, uint16_t trace, uint32_t start, uint32_t end)
+{
+    Span &s = spans[head % TRACE_SPANS];
+    s.start = start;
+    s.dur = end - start;
+    s.trace = trace;
+    s.name = name;
+    s.pad = 0;
+    head = head + 1;
+}
+
+// copy spans from seq on, seq is moved to the oldest span still kept
+int Tracer::read(uint32_t &seq, Span *buf, int n)
+{
+    uint32_t h = head;
+    int32_t behind = h - seq;
+    if (behind < 0 || behind > TRACE_SPANS) {
+        // overwritten, or this board was restarted
+        seq = h > TRACE_SPANS ? h - TRACE_SPANS : 0;
+    }
+    int count = 0;
+    for (; count < n && seq + count != h ; count++) {
+        buf[count] = spans[(seq + count) % TRACE_SPANS];
+    }
+    return count;
+}
+
+// response to CMD_SPANS, from an interrupt handler
+int Tracer::pack(const unsigned char *req, int reqlen, unsigned char *res)
+{
+    uint32_t seq = reqlen >= 5 ? unpack32(req + 1) : 0;
+    Span buf[TRACE_READ_SPANS];
+    int n = read(seq, buf, TRACE_READ_SPANS);
+    memset(res, 0, TRACE_READ_LEN);
+    res[0] = n;
+    pack32(res + 1, seq);
+    memcpy(res + 5, buf, n * sizeof(Span));
+    return TRACE_READ_LEN;
+}
+
+static void print_span(HTTP &http, const Span &s, int pid, uint32_t base)
+{
+    http.printf(",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%u,\"ts\":%lu,\"dur\":%lu,\"args\":{\"card\":%u}}",
+      span_name(s.name), pid, s.trace, (unsigned long)(s.start - base), (unsigned long)s.dur, s.trace);
+}
+
+void Tracer::init()
+{
+    WebServer::add("/trace", [](HTTP &http) {
+      // copy first, a card may be dealt while this is sent
+      std::vector<Span> local(TRACE_SPANS);
+      uint32_t seq = 0;
+      local.resize(::tracer.read(seq, local.data(), TRACE_SPANS));
+      std::vector<Span> remote;
+      bool merged = ::tracer.remote != NULL && ::tracer.remote(remote);
+
+      // timestamps from the oldest span, one row per card
+      uint32_t now = micros();
+      uint32_t base = now;
+      for (auto &s : local) {
+        base = int32_t(s.start - base) < 0 ? s.start : base;
+      }
+      for (auto &s : remote) {
+        base = int32_t(s.start - base) < 0 ? s.start : base;
+      }
+      http.header(200, "Trace");
+      http.printf("Content-Type: application/json\n");
+      http.body();
+      http.printf("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+      http.printf("\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"%s\"}}", ::tracer.board);
+      if (merged) {
+        http.printf(",\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":2,\"args\":{\"name\":\"%s\"}}", ::tracer.remote_board);
+      }
+      for (auto &s : local) {
+        print_span(http, s, 1, base);
+      }
+      for (auto &s : remote) {
+        print_span(http, s, 2, base);
+      }
+      http.printf("\n]}\n");
+      http.close();
+    });
+}
+
+//
+// ClockSync
+//
+
+void ClockSync::exchange(uint32_t t0, uint32_t remote, uint32_t t1)
+{
+    ClockSample s;
+    s.rtt = t1 - t0;
+    s.local = t0 + s.rtt / 2;
+    s.offset = int32_t(remote - s.local);
+    if (exchanges == 0 || s.rtt < best.rtt) {
+        best = s;
+    }
+    if (++exchanges < CLOCK_EXCHANGES) {
+        return;
+    }
+    samples[next] = best;
+    next = (next + 1) % CLOCK_SAMPLES;
+    nsamples = min(nsamples + 1, CLOCK_SAMPLES);
+    exchanges = 0;
+    update();
+}
+
+// least squares fit of the offsets, relative to the last sample
+void ClockSync::update()
+{
+    const ClockSample &last = samples[(next + CLOCK_SAMPLES - 1) % CLOCK_SAMPLES];
+    double sx = 0, sy = 0, sxx = 0, sxy = 0;
+    for (int i = 0 ; i < nsamples ; i++) {
+        const ClockSample &s = samples[i];
+        double x = int32_t(s.local - last.local);
+        double y = int32_t(uint32_t(s.offset) - uint32_t(last.offset));
+        sx += x;
+        sy += y;
+        sxx += x * x;
+        sxy += x * y;
+    }
+    double n = nsamples;
+    double var = n * sxx - sx * sx;
+    skew = nsamples > 1 && var > 0 ? (n * sxy - sx * sy) / var : 0;
+    // crystals are good to 100ppm or so, more is noise
+    skew = max(-0.001f, min(0.001f, skew));
+    ref = last.local;
+    offset = last.offset + int32_t((sy - skew * sx) / n);
+    rtt = last.rtt;
+}
+
+uint32_t ClockSync::to_local(uint32_t remote) const
+{
+    uint32_t local = remote - offset;
+    return remote - (offset + int32_t(skew * int32_t(local - ref)));
+}
@@ -0,0 +1,98 @@
+// (c)2024, Arthur van Hoff, Artfahrt Inc.
+#pragma once
+#include "util.h"
+
+#define TRACE_SPANS         256         // spans kept, power of two
+#define TRACE_READ_SPANS    8           // spans per CMD_SPANS response
+#define TRACE_READ_LEN      (5 + TRACE_READ_SPANS * sizeof(Span))
+#define CLOCK_EXCHANGES     4           // CMD_TIME exchanges per sync, the fastest is kept
+#define CLOCK_SAMPLES       8           // syncs used to estimate the skew
+
+enum SpanName {
+    SPAN_NONE,
+    // dealer
+    SPAN_IDENTIFY,                  // capture sent until identified
+    SPAN_LOAD,                      // loading until the card has settled
+    SPAN_ROTATE,                    // rotating to the owner
+    SPAN_EJECT,                     // ejecting until the card has left
+    // camera
+    SPAN_LIGHT,                     // capture received until the light is on
+    SPAN_FRAME,                     // frame grab
+    SPAN_MATCH,                     // locate and match card and suit
+    SPAN_NNAMES,
+};
+
+extern const char *span_name(int name);
+
+//
+// A timed step in the life of a card, in micros of the board that
+// recorded it. The trace id is assigned by the dealer when a card is
+// captured and is passed to the camera in CMD_CAPTURE and CMD_IDENTIFY.
+//
+struct Span {
+    uint32_t start;
+    uint32_t dur;
+    uint16_t trace;
+    uint8_t name;
+    uint8_t pad;
+};
+
+//
+// Ring buffer of recent spans. Spans are numbered from boot, so a
+// reader can page through them with CMD_SPANS: seq (32 bit LE), the
+// response is count, seq of the first span, and up to TRACE_READ_SPANS
+// spans. /trace returns the spans as Chrome trace JSON, merged with
+// the spans of other boards by the remote handler.
+//
+class Tracer : public InitComponent {
+  public:
+    typedef bool (*Remote)(std::vector<Span> &spans);
+    const char *board;
+    Span spans[TRACE_SPANS];
+    volatile uint32_t head = 0;
+    Remote remote = NULL;           // spans of another board, in local time
+    const char *remote_board = NULL;
+
+  public:
+    Tracer(const char *board) : InitComponent("Trace"), board(board) {}
+    virtual void init();
+
+    void add(int name, uint16_t trace, uint32_t start, uint32_t end);
+    int read(uint32_t &seq, Span *buf, int n);
+    int pack(const unsigned char *req, int reqlen, unsigned char *res);
+};
+
+//
+// Offset and skew of a remote clock, NTP style. Each sync takes the
+// exchange with the shortest round trip, assuming the remote time was
+// read half way, so the error is at most half that round trip. The
+// skew is the least squares slope of the offsets of the last syncs.
+//
+struct ClockSample {
+    uint32_t local;
+    int32_t offset;                 // remote - local
+    uint32_t rtt;
+};
+
+class ClockSync {
+  public:
+    ClockSample samples[CLOCK_SAMPLES];
+    int nsamples = 0;
+    int next = 0;
+    ClockSample best;
+    int exchanges = 0;
+    int32_t offset = 0;             // at ref
+    uint32_t ref = 0;
+    float skew = 0;                 // remote us per local us, minus 1
+    uint32_t rtt = 0;
+
+  public:
+    void exchange(uint32_t t0, uint32_t remote, uint32_t t1);
+    bool synced() const { return nsamples > 0; }
+    uint32_t to_local(uint32_t remote) const;
+
+  private:
+    void update();
+};
+
+extern Tracer tracer;
@@ -1,6 +1,7 @@
 // (c)2024, Arthur van Hoff, Artfahrt Inc.
 
 #include "util.h"
+#include "webserver.h"
 
 #ifdef USE_SERIAL
 bool verbose = true;
@@ -28,7 +29,12 @@ void InitComponent::init_all()
 {
     for (InitComponent *p = first ; p != NULL ; p = p->next ) {
       dprintf("init %s", p->name);
+      unsigned long c = cycle_count();
       p->init();
+      p->init_us = cycles_to_us(cycle_count() - c);
+      if (p->init_us > IDLE_BUDGET_US) {
+        dprintf("init %s took %lums", p->name, p->init_us / 1000);
+      }
     }
 }
 void InitComponent::halt_all() 
@@ -43,21 +49,251 @@ void InitComponent::halt_all()
 // IdleComponent
 //
 IdleComponent *IdleComponent::first = NULL;
+static std::vector<IdleComponent *> idle_heap;
+static std::atomic<int> idle_wakes(0);
+#ifdef ARDUINO
+static TaskHandle_t idle_task = NULL;
+#endif
+
+#define due_before(a, b)    (long((a) - (b)) < 0)
+
+void IdleComponent::sift_up(int i)
+{
+    IdleComponent *p = idle_heap[i];
+    while (i > 0) {
+      int parent = (i - 1) / 2;
+      if (!due_before(p->due_tm, idle_heap[parent]->due_tm)) {
+        break;
+      }
+      idle_heap[i] = idle_heap[parent];
+      idle_heap[i]->slot = i;
+      i = parent;
+    }
+    idle_heap[i] = p;
+    p->slot = i;
+}
+
+void IdleComponent::sift_down(int i)
+{
+    int n = idle_heap.size();
+    IdleComponent *p = idle_heap[i];
+    for (;;) {
+      int c = 2 * i + 1;
+      if (c >= n) {
+        break;
+      }
+      if (c + 1 < n && due_before(idle_heap[c + 1]->due_tm, idle_heap[c]->due_tm)) {
+        c += 1;
+      }
+      if (!due_before(idle_heap[c]->due_tm, p->due_tm)) {
+        break;
+      }
+      idle_heap[i] = idle_heap[c];
+      idle_heap[i]->slot = i;
+      i = c;
+    }
+    idle_heap[i] = p;
+    p->slot = i;
+}
+
+void IdleComponent::reschedule(unsigned long due)
+{
+    due_tm = due;
+    if (slot >= 0) {
+      sift_up(slot);
+      sift_down(slot);
+    }
+}
+
+// not safe from an interrupt handler, use wake()
+void IdleComponent::schedule(int interval)
+{
+    this->interval = interval;
+    reschedule(last_idle_tm + interval);
+}
+
+void IdleComponent::wake()
+{
+    woken = true;
+    idle_wakes++;
+#ifdef ARDUINO
+    if (idle_task != NULL) {
+      if (xPortInIsrContext()) {
+        vTaskNotifyGiveFromISR(idle_task, NULL);
+      } else {
+        xTaskNotifyGive(idle_task);
+      }
+    }
+#endif
+}
+
+unsigned long IdleComponent::next_due()
+{
+    return idle_heap.size() > 0 ? idle_heap[0]->due_tm : millis();
+}
 
 void IdleComponent::idle_all() 
 {
-    bool handled = false;
+    if (idle_heap.size() == 0) {
+      for (IdleComponent *p = first ; p != NULL ; p = p->next) {
+        p->slot = idle_heap.size();
+        idle_heap.push_back(p);
+        sift_up(p->slot);
+      }
+#ifdef ARDUINO
+      idle_task = xTaskGetCurrentTaskHandle();
+#endif
+      if (idle_heap.size() == 0) {
+        return;
+      }
+    }
     unsigned long now = millis();
-    for (IdleComponent *p = first ; p != NULL ; p = p->next) {
-      if (p->last_idle_tm + p->interval <= now) {
-          p->idle(now);
-          p->last_idle_tm = now;
-          handled = true;
+    if (idle_wakes.exchange(0) > 0) {
+      for (IdleComponent *p = first ; p != NULL ; p = p->next) {
+        if (p->woken) {
+          p->woken = false;
+          p->reschedule(now);
+        }
+      }
+    }
+    // take everything that is due off the heap first, so that each component
+    // runs at most once per call, interval 0 means every call
+    static std::vector<IdleComponent *> ready;
+    while (idle_heap.size() > 0 && !due_before(now, idle_heap[0]->due_tm)) {
+      ready.push_back(idle_heap[0]);
+      idle_heap[0]->slot = -1;
+      idle_heap[0] = idle_heap.back();
+      idle_heap.pop_back();
+      if (idle_heap.size() > 0) {
+        sift_down(0);
       }
     }
-    if (!handled) {
+    for (IdleComponent *p : ready) {
+      if (long(now - p->due_tm) > IDLE_LATE_MS) {
+        p->misses++;
+        p->late_max = max(p->late_max, now - p->due_tm);
+      }
+      unsigned long c = cycle_count();
+      p->idle(now);
+      unsigned long us = cycles_to_us(cycle_count() - c);
+      p->runtime.add(us);
+      if (us > p->budget_us) {
+        p->overruns++;
+        if (now - p->overrun_tm >= 1000) {
+          p->overrun_tm = now;
+          dprintf("idle: %s took %luus, budget %luus", p->name, us, p->budget_us);
+        }
+      }
+      p->last_idle_tm = now;
+      p->due_tm = now + p->interval;
+      p->slot = idle_heap.size();
+      idle_heap.push_back(p);
+      sift_up(p->slot);
+    }
+    ready.clear();
+    unsigned long due = idle_heap[0]->due_tm;
+    now = millis();
+    if (due_before(now, due)) {
+#ifdef ARDUINO
+      // sleep until the next deadline or a wake()
+      ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(due - now));
+#else
       delayMicroseconds(10);
+#endif
+    }
+}
+
+IdleComponent *IdleComponent::find(const char *name)
+{
+    for (IdleComponent *p = first ; p != NULL ; p = p->next) {
+      if (strcmp(p->name, name) == 0) {
+        return p;
+      }
+    }
+    return NULL;
+}
+
+void IdleComponent::print(HTTP &http)
+{
+    http.printf("%-16s %8s %7s %7s %7s %7s %7s %7s %6s %6s %5s\n", "name", "count", "avg", "p50", "p95", "p99", "max", "budget", "over", "late", "worst");
+    for (IdleComponent *p = first ; p != NULL ; p = p->next) {
+      Histogram &h = p->runtime;
+      http.printf("%-16s %8lu %7lu %7lu %7lu %7lu %7lu %5lums %6lu %6lu %3lums\n", p->name, h.count, h.average(), h.percentile(50), h.percentile(95), h.percentile(99), h.maximum, 
+          p->budget_us / 1000, p->overruns, p->misses, p->late_max);
+    }
+    http.printf("\ninit (us):\n");
+    for (InitComponent *p = InitComponent::first ; p != NULL ; p = p->next) {
+      http.printf("%-16s %8lu\n", p->name, p->init_us);
+    }
+}
+
+// serial report of components that went over budget since the last report
+void IdleComponent::report()
+{
+    for (IdleComponent *p = first ; p != NULL ; p = p->next) {
+      if (p->overruns != p->reported) {
+        dprintf("idle: %s over budget %lu times, max=%luus, p95=%luus", p->name, p->overruns - p->reported, p->runtime.maximum, p->runtime.percentile(95));
+        p->reported = p->overruns;
+      }
+    }
+}
+
+void IdleComponent::reset()
+{
+    for (IdleComponent *p = first ; p != NULL ; p = p->next) {
+      p->runtime.reset();
+      p->overruns = 0;
+      p->reported = 0;
+      p->misses = 0;
+      p->late_max = 0;
+    }
+}
+
+//
+// Histogram
+//
+
+void Histogram::reset()
+{
+    count = 0;
+    total = 0;
+    maximum = 0;
+    for (int i = 0 ; i < HISTOGRAM_BUCKETS ; i++) {
+      buckets[i] = 0;
+    }
+}
+
+void Histogram::add(unsigned long v)
+{
+    count += 1;
+    total += v;
+    maximum = max(maximum, v);
+    buckets[bucket(v)] += 1;
+}
+
+int Histogram::bucket(unsigned long v)
+{
+    int b = v == 0 ? 0 : 32 - __builtin_clz(v);
+    return min(b, HISTOGRAM_BUCKETS - 1);
+}
+
+unsigned long Histogram::bucket_max(int b)
+{
+    return b == 0 ? 0 : (1UL << b) - 1;
+}
+
+// upper bound of the bucket that contains the p-th percentile
+unsigned long Histogram::percentile(int p)
+{
+    unsigned long n = (count * p + 99) / 100;
+    unsigned long sum = 0;
+    for (int b = 0 ; b < HISTOGRAM_BUCKETS ; b++) {
+      sum += buckets[b];
+      if (sum >= n && sum > 0) {
+        return b == HISTOGRAM_BUCKETS - 1 ? maximum : min(maximum, bucket_max(b));
+      }
     }
+    return maximum;
 }
 
 //
@@ -6,6 +6,8 @@
 #include <cstdio>
 #include <vector>
 #include <map>
+#include <mutex>
+#include <atomic>
 #include "defs.h"
 
 #ifndef max
@@ -23,10 +25,46 @@ extern void dprintf(const char *fmt, ...);
 #define dprintf(...)
 #endif
 
+//
+// Histogram with log2 buckets, used for latency measurements in micros.
+// Bucket 0 holds 0, bucket b holds [2^(b-1), 2^b), the last bucket holds the rest.
+//
+#define HISTOGRAM_BUCKETS   16
+
+class Histogram {
+  public:
+    unsigned long count;
+    unsigned long long total;
+    unsigned long maximum;
+    unsigned long buckets[HISTOGRAM_BUCKETS];
+
+  public:
+    Histogram() { reset(); }
+    void reset();
+    void add(unsigned long v);
+    unsigned long average() { return count == 0 ? 0 : total / count; }
+    unsigned long percentile(int p);
+
+    static int bucket(unsigned long v);
+    static unsigned long bucket_max(int b);
+};
+
+//
+// Cycle counter, for measuring short durations
+//
+#ifdef ARDUINO
+inline unsigned long cycle_count() { return ESP.getCycleCount(); }
+inline unsigned long cycles_to_us(unsigned long c) { return c / ESP.getCpuFreqMHz(); }
+#else
+inline unsigned long cycle_count() { return micros(); }
+inline unsigned long cycles_to_us(unsigned long c) { return c; }
+#endif
+
 class InitComponent {
   public:
     const char *name;
     InitComponent *next = NULL;
+    unsigned long init_us = 0;          // time spent in init()
     static InitComponent *first;
 
   public:
@@ -44,10 +82,29 @@ class InitComponent {
     static void halt_all();
 };
 
+#define IDLE_BUDGET_US      5000        // default budget for one idle() call
+#define IDLE_LATE_MS        2           // starting later than this is a deadline miss
+
+//
+// Idle components are kept in a min-heap ordered by when they are due next,
+// the idle loop runs whatever is due and sleeps until the next deadline.
+// Use schedule() to change the interval, and wake() to run a component 
+// as soon as possible (also from an interrupt handler or another task).
+//
 class IdleComponent : public InitComponent {
   public:
     int interval;
     unsigned long last_idle_tm;
+    unsigned long due_tm = 0;
+    int slot = -1;                      // index in the heap
+    volatile bool woken = false;
+    Histogram runtime;                  // time spent in idle(), in micros
+    unsigned long budget_us = IDLE_BUDGET_US;
+    unsigned long overruns = 0;         // idle() calls that exceeded the budget
+    unsigned long misses = 0;           // idle() calls that started late
+    unsigned long late_max = 0;         // worst start delay, in ms
+    unsigned long reported = 0;         // overruns at the last report
+    unsigned long overrun_tm = 0;
     IdleComponent *next = NULL;
     static IdleComponent *first;
 
@@ -60,8 +117,50 @@ class IdleComponent : public InitComponent {
 
     virtual void idle(unsigned long now) {}
 
+    void schedule(int interval);
+    void wake();
+
     static void idle_all();
+    static unsigned long next_due();
+    static IdleComponent *find(const char *name);
+    static void print(class HTTP &http);
+    static void report();
+    static void reset();
+  private:
+    void reschedule(unsigned long due);
+    static void sift_up(int i);
+    static void sift_down(int i);
 };
 
+//
+// Resumable tasks, in the style of protothreads. A task function returns
+// bool, true when it is done. It is called again (usually from idle) and 
+// continues after the wait where it left off. Locals do not survive a
+// wait, keep state in members, and don't wait inside a switch.
+//
+//    bool Thing::step() {
+//        TASK_BEGIN(task);
+//        TASK_DELAY(task, 200);
+//        TASK_WAIT_UNTIL(task, ready());
+//        TASK_END(task);
+//    }
+//
+struct Task {
+    int line = 0;               // resume point, 0 is the start
+    unsigned long wait_tm = 0;
+
+    inline void restart() { line = 0; }
+    inline bool running() { return line != 0; }
+};
+
+#define TASK_BEGIN(t)           switch ((t).line) { case 0:
+#define TASK_END(t)             } (t).line = 0; return true
+#define TASK_EXIT(t)            do { (t).line = 0; return true; } while (0)
+#define TASK_YIELD(t)           do { (t).line = __LINE__; return false; case __LINE__:; } while (0)
+#define TASK_WAIT_UNTIL(t, c)   do { (t).line = __LINE__; case __LINE__: if (!(c)) return false; } while (0)
+#define TASK_DELAY(t, ms)       do { (t).wait_tm = millis() + (ms); TASK_WAIT_UNTIL(t, long(millis() - (t).wait_tm) >= 0); } while (0)
+#define TASK_TIMEDOUT(t)        (long(millis() - (t).wait_tm) >= 0)
+#define TASK_WAIT_UNTIL_TIMEOUT(t, c, ms) do { (t).wait_tm = millis() + (ms); TASK_WAIT_UNTIL(t, (c) || TASK_TIMEDOUT(t)); } while (0)
+
 extern void init_all(const char *name);
 extern void idle_all();
@@ -47,6 +47,8 @@ static void wifi_report()
 // HTTP Server
 //
 
+#define FILE_PUT_BUFLEN     (10*1024)
+
 struct Handler {
   const char *path;
   void (*handler)(HTTP &);
@@ -56,6 +58,22 @@ static std::vector<Handler> handlers;
 void WebServer::init()
 {
     networkIndex = 0;
+    add("/components", [](HTTP &http) {
+      if (http.param.count("budget") && http.param.count("name")) {
+        IdleComponent *p = IdleComponent::find(http.param["name"].c_str());
+        if (p != NULL) {
+          p->budget_us = atoi(http.param["budget"].c_str());
+        }
+      }
+      if (http.param["reset"] == "1") {
+        IdleComponent::reset();
+      }
+      http.header(200, "Component Stats");
+      http.printf("Content-Type: text/plain\n");
+      http.body();
+      IdleComponent::print(http);
+      http.close();
+    });
 #if USE_WIFI
     wifi_connect();
 #endif
@@ -89,6 +107,8 @@ void WebServer::idle(unsigned long now)
             it++;
           }
         }
+        // poll quickly while there are requests in progress
+        schedule(active.size() > 0 ? 1 : 100);
         return;
     }
     if (connected) {
@@ -104,6 +124,8 @@ void WebServer::idle(unsigned long now)
         connected = true;
         wifi_report();
         server.begin();
+        // wall clock in UTC, for timestamps that outlive a reboot
+        configTime(0, 0, "pool.ntp.org", "time.google.com");
         return;
     }
     if (now - connectTime < connectTimeout) {
@@ -163,33 +185,33 @@ void WebServer::add(const char *path, void (*handler)(HTTP &))
 //
 // HTTP
 //
-void WebServer::file_put_handler(HTTP &http)
+// resumable, reads as much as is available and returns to the idle loop
+static bool file_put_step(HTTP &http)
 {
+  TASK_BEGIN(http.task);
   if (http.method != "PUT") {
     http.header(405, "Method Not Allowed");
     http.close();
-    return;
+    TASK_EXIT(http.task);
   }
-  unsigned long clen = http.hdrs.count("content-length") ? atoi(http.hdrs["content-length"].c_str()) : -1;
-  if (clen < 0) {
+  http.content_length = http.hdrs.count("content-length") ? atoi(http.hdrs["content-length"].c_str()) : -1;
+  if (http.content_length < 0) {
     http.header(411, "Length Required");
     http.close();
-    return;
+    TASK_EXIT(http.task);
   }
-  const char *path = http.path.c_str();
-  File file = LittleFS.open(path, FILE_WRITE);
-  if (!file) {
+  http.file = LittleFS.open(http.path.c_str(), FILE_WRITE);
+  if (!http.file) {
     http.header(404, "File Not Write");
     http.close();
-    return;
+    TASK_EXIT(http.task);
   }
 
-  int buflen = 10*1024;
-  auto buf = std::shared_ptr<unsigned char[]>(new unsigned char[buflen]);
-  if (buf == NULL) {
+  http.buf = std::shared_ptr<unsigned char[]>(new unsigned char[FILE_PUT_BUFLEN]);
+  if (http.buf == NULL) {
     http.header(404, "Out of Memory");
-    file.close();
-    return;
+    http.file.close();
+    TASK_EXIT(http.task);
   }
 
   if (http.hdrs.count("expect") && http.hdrs["expect"] == "100-continue") {
@@ -198,21 +220,35 @@ void WebServer::file_put_handler(HTTP &http)
     http.client.flush();
   }
 
-  for (unsigned long bytes = 0 ; bytes < clen ; ){
-    if (http.client.available()) {
-      int n = http.client.readBytes(buf.get(), buflen);
-      file.write(buf.get(), n);
-      bytes += n;
-    } else {
-      delay(1);
+  for (http.bytes = 0 ; http.bytes < http.content_length ; ) {
+    TASK_WAIT_UNTIL(http.task, http.client.available() > 0 || !http.client.connected());
+    if (!http.client.connected()) {
+      dprintf("http: lost connection during upload of %s", http.path.c_str());
+      http.file.close();
+      http.close();
+      TASK_EXIT(http.task);
+    }
+    {
+      int n = http.client.readBytes(http.buf.get(), min(FILE_PUT_BUFLEN, http.client.available()));
+      http.file.write(http.buf.get(), n);
+      http.bytes += n;
+      // progress, don't time out
+      http.http_tm = millis();
     }
   }
 
-  file.close();
+  http.file.close();
+  http.buf = NULL;
   http.header(201, "File Created");
-  http.printf("Content-Location: %s\n", path);
+  http.printf("Content-Location: %s\n", http.path.c_str());
   http.body();
   http.close();
+  TASK_END(http.task);
+}
+
+void WebServer::file_put_handler(HTTP &http)
+{
+  file_put_step(http);
 }
 
 void WebServer::file_get_handler(HTTP &http)
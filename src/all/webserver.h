@@ -3,6 +3,7 @@
 
 #include "util.h"
 #include <WiFi.h>
+#include <FS.h>
 
 #define MAX_HANDLERS 64
 
@@ -26,6 +27,13 @@ class HTTP {
     std::map<String,String> param;
     HTTPState state = HTTP_IDLE;
     void (*handler)(HTTP &) = NULL;
+
+    // state for resumable handlers
+    Task task;
+    File file;
+    long content_length = 0;
+    long bytes = 0;
+    std::shared_ptr<unsigned char[]> buf;
   public:
     HTTP(WiFiClient &client) : client(client), http_tm(millis()) {}
     int idle(class WebServer *server, unsigned long now);
@@ -4,6 +4,7 @@
 #include "camera.h"
 #include "image.h"
 #include "webserver.h"
+#include "trace.h"
 
 #if defined(CAMERA_MODEL_XIAO_ESP32S3)
 #define PWDN_GPIO_NUM     -1
@@ -175,6 +176,11 @@ void Camera::init()
     }
 
     WebServer::add("/original.jpg", [](HTTP &http) {
+        // the handler is called again until the light is on
+        light.on(100, 1000);
+        if (!cam.lightReady()) {
+            return;
+        }
         camera_fb_t *fb = cam.capture();
 
         for (int i = 0 ; i < 10 && fb != NULL ; i++) {
@@ -296,6 +302,18 @@ void Camera::clearCard(bool learn)
     }
 }
 
+// continue a deal that was interrupted, keep the images if possible
+void Camera::restoreCard(bool learn, int count, int prev)
+{
+    if (learn != learning || (learn && cardsuit.data == NULL) || overview.data == NULL) {
+        clearCard(learn);
+    }
+    dprintf("restoring cards, count=%d, prev=%s", count, full_name(prev));
+    last_card = CARD_NULL;
+    prev_card = prev;
+    card_count = count;
+}
+
 Image frms[2];
 
 camera_fb_t *Camera::capture()
@@ -304,8 +322,8 @@ camera_fb_t *Camera::capture()
     // turn on the light
     light.on(100, 1000);
 
-    // wait for the light to come on
-    while (millis() < light.on_tm + light_delay) {
+    // wait for the light to come on, see startCapture for a version that doesn't block
+    while (!lightReady()) {
         delay(1);
     }
 
@@ -328,15 +346,51 @@ camera_fb_t *Camera::capture()
     }
 }
 
+// capture in idle, once the light is on
+void Camera::startCapture()
+{
+    last_card = CARD_NULL;
+    capturing = true;
+    task.restart();
+    schedule(1);
+    wake();
+}
+
+bool Camera::lightReady()
+{
+    return light.value && long(millis() - (light.on_tm + light_delay)) >= 0;
+}
+
+void Camera::idle(unsigned long now)
+{
+    if (capturing && capture_step()) {
+        capturing = false;
+        schedule(1000);
+    }
+}
+
+// resumable
+bool Camera::capture_step()
+{
+    TASK_BEGIN(task);
+    light.on(100, 1000);
+    TASK_WAIT_UNTIL(task, lightReady());
+    tracer.add(SPAN_LIGHT, trace, capture_us, micros());
+    captureCard();
+    TASK_END(task);
+}
+
 bool Camera::captureCard()
 {
     for (int attempt = 0 ; ; attempt++) {
         dprintf("capturing card, attempt=%d, learning=%d", attempt, learning);
         last_card = CARD_NULL;
+        uint32_t frame_us = micros();
         camera_fb_t *fb = cam.capture();
         if (fb == NULL) {
             return false;
         }
+        tracer.add(SPAN_FRAME, trace, frame_us, micros());
 
         // pick useful region
         int x = WINDOW_X;
@@ -347,6 +401,7 @@ bool Camera::captureCard()
         esp_camera_fb_return(fb);
 
         // located card and suit
+        uint32_t match_us = micros();
         latest.locate(tmp, card, suit);
 
         // identify card OR learn
@@ -375,6 +430,7 @@ bool Camera::captureCard()
             //dprintf("setting last_card to learn_card=%d", learn_card);
             last_card = card_count;
         }
+        tracer.add(SPAN_MATCH, trace, match_us, micros());
         prev_card = last_card;
         dprintf("capture: frame %d, %s card %d as %s", frame_nr, learning ? "learn" : "identify", card_count, full_name(last_card));
         if (cardsuit.data != NULL) {
@@ -5,7 +5,7 @@
 #include "util.h"
 #include "light.h"
 
-class Camera : InitComponent {
+class Camera : public IdleComponent {
   public:
     int frame_nr = 0;
     unsigned long frame_tm = 0;
@@ -13,15 +13,25 @@ class Camera : InitComponent {
     volatile int last_card = CARD_NULL;
     int prev_card = CARD_NULL;
     bool learning = false;
+    bool capturing = false;
+    volatile uint16_t trace = 0;    // of the card being captured, see trace.h
+    volatile uint32_t capture_us = 0;
+    Task task;
 
   public:
-    Camera() : InitComponent("capture") {}
+    Camera() : IdleComponent("capture", 1000) {}
     virtual void init();
+    virtual void idle(unsigned long now);
 
     camera_fb_t *capture();
     bool captureCard();
+    void startCapture();
+    bool lightReady();
     void clearCard(bool learn = false);
+    void restoreCard(bool learn, int count, int prev);
     void collate();
+  private:
+    bool capture_step();
 };
 
 extern LEDArray light;
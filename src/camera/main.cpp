@@ -7,11 +7,13 @@
 #include "image.h"
 #include "camera.h"
 #include "webserver.h"
+#include "trace.h"
 
 WebServer www;
 Storage storage;
 LEDArray light("camera-light", 8, 200);
 Camera cam;
+Tracer tracer("camera");
 extern Image cards;
 extern Image suits;
 
@@ -24,18 +26,31 @@ class Idler : public IdleComponent {
 
     virtual void idle(unsigned long now) {
       dprintf("%5d: %s, wifi=%d, store=%d, light=%d, frame=%d", i++, name, www.connected, storage.mounted, light.value, cam.frame_nr);
+      IdleComponent::report();
     }
 } idler;
 
-BusSlave bus(CAMERA_ADDR, [] (BusSlave &bus, BusSlave::Buffer &req, BusSlave::Buffer &res) {
+BusSlave bus(CAMERA_ADDR, BUS_ROLE_CAMERA, BUS_CAP_CAPTURE | BUS_CAP_LEARN | BUS_CAP_STATUS | BUS_CAP_TRACE, [] (BusSlave &bus, BusSlave::Buffer &req, BusSlave::Buffer &res) {
   // interrupt handler, NO blocking
   switch (req[0]) {
     case CMD_CAPTURE:
       cam.last_card = CARD_NULL;
+      cam.trace = req.size() >= 3 ? req[1] | (req[2] << 8) : 0;
+      cam.capture_us = micros();
       break;
     case CMD_IDENTIFY:
       res.resize(1);
-      res[0] = cam.last_card;
+      // not for an older capture
+      res[0] = req.size() >= 3 && (req[1] | (req[2] << 8)) != cam.trace ? CARD_NULL : cam.last_card;
+      break;
+    case CMD_TIME: {
+      uint32_t us = micros();
+      res = {(unsigned char)us, (unsigned char)(us >> 8), (unsigned char)(us >> 16), (unsigned char)(us >> 24)};
+      break;
+    }
+    case CMD_SPANS:
+      res.resize(TRACE_READ_LEN);
+      tracer.pack(req.data(), req.size(), res.data());
       break;
     case CMD_STATUS:
       res.resize(6);
@@ -60,7 +75,12 @@ BusSlave bus(CAMERA_ADDR, [] (BusSlave &bus, BusSlave::Buffer &req, BusSlave::Bu
       cam.clearCard(req[1]);
       break;
     case CMD_CAPTURE:
-      cam.captureCard();
+      cam.startCapture();
+      break;
+    case CMD_RESTORE:
+      if (req.size() >= 4) {
+        cam.restoreCard(req[1], req[2], req[3]);
+      }
       break;
     case CMD_COLLATE:
       cam.collate();
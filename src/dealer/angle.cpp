@@ -1,19 +1,17 @@
 // (c)2024, Arthur van Hoff, Artfahrt Inc.
-#include <Wire.h>
 #include "bus.h"
 #include "angle.h"
 #include "webserver.h"
+#include "event.h"
 
 extern BusMaster bus;
 extern AngleSensor angle;
 
 void AngleSensor::init()
 {
-    Wire.beginTransmission(0x36);
-    int error = Wire.endTransmission();
-    active = error == 0;
+    active = bus.check(bus.lookup(BUS_ROLE_ANGLE));
     if (!active) {
-        dprintf("warning: angle sensor not found, error=%d", error);
+        dprintf("warning: angle sensor not found");
         angle=360;
     }
     WebServer::add("/turn", [](HTTP &http) {
@@ -21,29 +19,81 @@ void AngleSensor::init()
       http.header(200, "Turning to Angle");
       http.close();
     });
+    WebServer::add("/motion", [](HTTP &http) {
+      MotionController &m = ::angle.motion;
+      for (auto i : http.param) {
+        float v = atof(i.second.c_str());
+        if (i.first == "shape") {
+          m.shape = i.second == "scurve" ? MOTION_SCURVE : MOTION_TRAPEZOID;
+        } else if (i.first == "vmax") {
+          m.vmax = v;
+        } else if (i.first == "amax") {
+          m.amax = v;
+        } else if (i.first == "jmax") {
+          m.jmax = v;
+        } else if (i.first == "kp") {
+          m.pid.kp = v;
+        } else if (i.first == "ki") {
+          m.pid.ki = v;
+        } else if (i.first == "kd") {
+          m.pid.kd = v;
+        } else if (i.first == "kff") {
+          m.kff = v;
+        } else if (i.first == "kacc") {
+          m.kacc = v;
+        } else if (i.first == "kstatic") {
+          m.kstatic = v;
+        } else if (i.first == "tolerance") {
+          m.tolerance = v;
+        }
+      }
+      http.header(200, "Motion Parameters");
+      http.printf("Content-Type: text/plain\n");
+      http.body();
+      http.printf("shape=%s vmax=%.1f amax=%.1f jmax=%.1f\n", m.shape == MOTION_SCURVE ? "scurve" : "trapezoid", m.vmax, m.amax, m.jmax);
+      http.printf("kp=%.3f ki=%.3f kd=%.3f kff=%.3f kacc=%.3f kstatic=%.1f tolerance=%.1f\n", m.pid.kp, m.pid.ki, m.pid.kd, m.kff, m.kacc, m.kstatic, m.tolerance);
+      http.printf("last move: distance=%.1f duration=%.3fs\n", m.profile.distance, m.profile.duration);
+      http.printf("samples skipped while the bus was busy: %lu\n", ::angle.skipped);
+      http.close();
+    });
 }
 
-void AngleSensor::idle(unsigned long now)
+void AngleSensor::control(unsigned long now_us, float dt)
 {
   if (active) {
+    // never wait for the bus here, a camera request with retries holds
+    // it for much longer than a tick, the sample is taken next time
+    std::unique_lock<std::recursive_mutex> busy(bus.lock, std::try_to_lock);
+    if (!busy.owns_lock()) {
+      skipped++;
+      return;
+    }
     angle = readAngle();
+    busy.unlock();
+    dt = sample_us == 0 ? dt : (now_us - sample_us) / 1000000.0f;
+    sample_us = now_us;
     if (angle < 360) {
       if (north < 0) {
         north = angle;
       }
       float current = value();
+      std::lock_guard<std::mutex> guard(lock);
       if (target_angle >= 0) {
-        float d = adiff(target_angle, current);
+        traveled += adiff(current, last_value);
+        last_value = current;
+        if (!reached && abs(adiff(target_angle, current)) < ANGLE_NEAR) {
+            // close enough to deal, while the motion settles
+            reached = true;
+            events.post(EV_ROTATION_REACHED, int(target_angle));
+        }
 
-        if (fabs(d) < 1) {
+        if (motion.done(traveled)) {
             rotator.stop();
-            interval = 1000;
+            divider = ANGLE_IDLE_DIVIDER;
             //dprintf("angle: reached target=%f, current=%f", target_angle, current);
             target_angle = -1;
         } else {
-            int s = sign(d) * min(100, (int)fabs(d) + 40); 
-            //dprintf("angle: set speed=%d", s);
-            rotator.set_speed(s);
+            rotator.drive(motion.update(traveled, dt));
         }
       }
     }
@@ -53,8 +103,14 @@ void AngleSensor::idle(unsigned long now)
 void AngleSensor::turnTo(float target)
 {
     //dprintf("angle: turnTo %f, current=%f", target, value());
+    std::lock_guard<std::mutex> guard(lock);
     target_angle = mod360(target);
-    interval = 1;
+    reached = false;
+    last_value = value();
+    traveled = 0;
+    // always the shortest way around
+    motion.start(adiff(target_angle, last_value));
+    divider = ANGLE_ACTIVE_DIVIDER;
 }
 
 //
@@ -65,13 +121,13 @@ float AngleSensor::readAngle()
   unsigned char res[1];
 
   //7:0 - bits
-  if (!bus.request(0x36, (const unsigned char[]){0x0D}, 1, res, sizeof(res))) {
+  if (!bus.request(BUS_ROLE_ANGLE, (const unsigned char[]){0x0D}, 1, res, sizeof(res))) {
     return 360;
   }
   int lowbyte = res[0];
  
   //11:8 - 4 bits
-  if (!bus.request(0x36, (const unsigned char[]){0x0C}, 1, res, sizeof(res))) {
+  if (!bus.request(BUS_ROLE_ANGLE, (const unsigned char[]){0x0C}, 1, res, sizeof(res))) {
     return 360;
   }
   int highbyte = res[0];
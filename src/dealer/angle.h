@@ -3,31 +3,44 @@
 #pragma once
 #include "util.h"
 #include "motor.h"
+#include "motion.h"
+#include "control.h"
 
 #define mod360(a)   ((a) - floor((a) / 360.0f) * 360.0f)
 #define adiff(a, b)  (mod360((a - b) + 180.0f) - 180.0f)
 #define sign(x)     ((x) > 0 ? 1 : ((x) < 0 ? -1 : 0))
 
-class AngleSensor : public IdleComponent {
+#define ANGLE_NEAR              5       // degrees, close enough to deal
+#define ANGLE_ACTIVE_DIVIDER    2       // sample at 500Hz while turning
+#define ANGLE_IDLE_DIVIDER      100     // sample at 10Hz otherwise
+
+class AngleSensor : public ControlComponent {
   public:
     Motor &rotator;
     float north = -1;
     float angle = 0;
     float target_angle = -1;
     bool active = true;
+    MotionController motion;
+    float traveled = 0;
+    float last_value = 0;
+    bool reached = false;
+    std::mutex lock;                // turnTo races with the control loop
+    unsigned long sample_us = 0;
+    unsigned long skipped = 0;      // samples skipped while the bus was busy
 
   public:
-    AngleSensor(const char *name, Motor &rotator) : IdleComponent(name, 1000), rotator(rotator) {}
+    AngleSensor(const char *name, Motor &rotator) : ControlComponent(name, ANGLE_IDLE_DIVIDER), rotator(rotator) {}
 
     void init();
 
-    virtual void idle(unsigned long now);
+    virtual void control(unsigned long now_us, float dt);
 
     inline float value() {
       return north < 0 ? angle : mod360(angle - north);
     }
     inline bool near(float a) {
-      return abs(adiff(a, value())) < 5;
+      return abs(adiff(a, value())) < ANGLE_NEAR;
     }
 
     void turnTo(float target);
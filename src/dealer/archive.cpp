@@ -0,0 +1,380 @@
+// (c)2024, Arthur van Hoff, Artfahrt Inc.
+#include "archive.h"
+#include "webserver.h"
+#include <LittleFS.h>
+#include <time.h>
+
+static inline int shape_length(uint16_t shape, int suit)
+{
+    return (shape >> (suit * 4)) & 0xF;
+}
+
+static inline int shape_shortest(uint16_t shape)
+{
+    return min(min(shape_length(shape, 0), shape_length(shape, 1)), min(shape_length(shape, 2), shape_length(shape, 3)));
+}
+
+// see hand_balanced
+static bool shape_balanced(uint16_t shape)
+{
+    int doubletons = 0;
+    for (int s = 0 ; s < NSUITS ; s++) {
+        doubletons += shape_length(shape, s) == 2;
+    }
+    return shape_shortest(shape) >= 2 && doubletons <= 1;
+}
+
+// the hcp and shape columns of a row match a constraint
+bool archive_match(const DealConstraint &c, const uint8_t *hcp, const uint16_t *shape)
+{
+    for (int p = 0 ; p < NPLAYERS ; p++) {
+        const SeatConstraint &seat = c.seats[p];
+        if (hcp[p] < seat.hcp_min || hcp[p] > seat.hcp_max) {
+            return false;
+        }
+        for (int s = 0 ; s < NSUITS ; s++) {
+            int len = shape_length(shape[p], s);
+            if (len < seat.len_min[s] || len > seat.len_max[s]) {
+                return false;
+            }
+        }
+        if (seat.balanced >= 0 && shape_balanced(shape[p]) != seat.balanced) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// the fixed cards of a constraint, the deal is only decoded for these
+bool archive_match_fixed(const DealConstraint &c, const DealId &id)
+{
+    if (c.fixed == 0) {
+        return true;
+    }
+    Bitboard bits;
+    if (!id.decode(bits)) {
+        return false;
+    }
+    for (int p = 0 ; p < NPLAYERS ; p++) {
+        if ((bits.hands[p] & c.seats[p].fixed) != c.seats[p].fixed) {
+            return false;
+        }
+    }
+    return true;
+}
+
+//
+// ArchiveIndex
+//
+
+void ArchiveIndex::clear()
+{
+    memset(this, 0, sizeof(*this));
+    time_min = 0xFFFFFFFF;
+    memset(hcp_min, 0xFF, sizeof(hcp_min));
+    memset(len_min, 0xFF, sizeof(len_min));
+}
+
+void ArchiveIndex::add(const ArchiveRow &row)
+{
+    time_min = min(time_min, row.time);
+    time_max = max(time_max, row.time);
+    for (int p = 0 ; p < NPLAYERS ; p++) {
+        hcp_min[p] = min(hcp_min[p], row.hcp[p]);
+        hcp_max[p] = max(hcp_max[p], row.hcp[p]);
+        for (int s = 0 ; s < NSUITS ; s++) {
+            uint8_t len = shape_length(row.shape[p], s);
+            len_min[p][s] = min(len_min[p][s], len);
+            len_max[p][s] = max(len_max[p][s], len);
+        }
+        short_max[p] = max(short_max[p], (uint8_t)shape_shortest(row.shape[p]));
+    }
+    count++;
+}
+
+// false if no row in the block can match
+bool ArchiveIndex::may_match(const DealConstraint &c) const
+{
+    for (int p = 0 ; p < NPLAYERS ; p++) {
+        const SeatConstraint &seat = c.seats[p];
+        if (seat.hcp_max < hcp_min[p] || seat.hcp_min > hcp_max[p]) {
+            return false;
+        }
+        for (int s = 0 ; s < NSUITS ; s++) {
+            if (seat.len_max[s] < len_min[p][s] || seat.len_min[s] > len_max[p][s]) {
+                return false;
+            }
+        }
+        if (seat.balanced == 1 && short_max[p] < 2) {
+            return false;
+        }
+    }
+    return true;
+}
+
+//
+// Archive
+//
+
+bool Archive::add(const Deal &deal, int board)
+{
+    // a block that failed to write, the filesystem may be full
+    if (tail_count == ARCHIVE_BLOCK && !flush()) {
+        dprintf("archive: tail full, board not archived");
+        return false;
+    }
+    Bitboard bits(deal);
+    ArchiveRow &row = tail[tail_count];
+    if (!row.id.encode(bits)) {
+        dprintf("archive: invalid deal");
+        return false;
+    }
+    // the clock is set by SNTP once there is WiFi
+    time_t now = time(NULL);
+    row.time = now >= ARCHIVE_CLOCK_SET ? now : 0;
+    row.board = board < 0 ? ARCHIVE_NOBOARD : board;
+    row.dealer = deal.dealer;
+    row.machine = machine;
+    for (int p = 0 ; p < NPLAYERS ; p++) {
+        row.hcp[p] = hand_hcp(bits.hands[p]);
+        row.shape[p] = hand_shape(bits.hands[p]);
+    }
+
+    // the tail starts with the block it belongs to
+    File file = LittleFS.open(ARCHIVE_TAIL, tail_count == 0 ? FILE_WRITE : FILE_APPEND);
+    if (!file) {
+        dprintf("error: failed to open for write: %s", ARCHIVE_TAIL);
+        return false;
+    }
+    if (tail_count == 0) {
+        uint32_t b = blocks;
+        file.write((const uint8_t *)&b, sizeof(b));
+    }
+    file.write((const uint8_t *)&row, sizeof(row));
+    file.close();
+    tail_count++;
+    return tail_count < ARCHIVE_BLOCK || flush();
+}
+
+// write the full tail as a block
+bool Archive::flush()
+{
+    ArchiveBlock *block = new ArchiveBlock;
+    ArchiveIndex index;
+    index.clear();
+    memset(block, 0, sizeof(*block));
+    for (int i = 0 ; i < tail_count ; i++) {
+        const ArchiveRow &row = tail[i];
+        memcpy(block->id[i], row.id.w, sizeof(block->id[i]));
+        block->time[i] = row.time;
+        block->board[i] = row.board;
+        block->dealer[i] = row.dealer;
+        block->machine[i] = row.machine;
+        for (int p = 0 ; p < NPLAYERS ; p++) {
+            block->hcp[p][i] = row.hcp[p];
+            block->shape[p][i] = row.shape[p];
+        }
+        index.add(row);
+    }
+
+    // the block first, at its place in case an earlier write was cut off
+    File file = LittleFS.open(ARCHIVE_FILE, LittleFS.exists(ARCHIVE_FILE) ? "r+" : FILE_WRITE);
+    bool ok = file && file.seek(blocks * sizeof(ArchiveBlock)) &&
+              file.write((const uint8_t *)block, sizeof(*block)) == sizeof(*block);
+    file.close();
+    delete block;
+    if (ok) {
+        file = LittleFS.open(ARCHIVE_INDEX, LittleFS.exists(ARCHIVE_INDEX) ? "r+" : FILE_WRITE);
+        ok = file && file.seek(blocks * sizeof(ArchiveIndex)) &&
+             file.write((const uint8_t *)&index, sizeof(index)) == sizeof(index);
+        file.close();
+    }
+    if (!ok) {
+        dprintf("archive: failed to write block %lu", blocks);
+        return false;
+    }
+    blocks++;
+    tail_count = 0;
+    LittleFS.remove(ARCHIVE_TAIL);
+    dprintf("archive: block %lu written, %lu boards", blocks, count());
+    return true;
+}
+
+void Archive::load()
+{
+    blocks = 0;
+    tail_count = 0;
+    File file = LittleFS.open(ARCHIVE_INDEX, FILE_READ);
+    if (file) {
+        blocks = file.size() / sizeof(ArchiveIndex);
+        file.close();
+    }
+    file = LittleFS.open(ARCHIVE_TAIL, FILE_READ);
+    if (file) {
+        uint32_t b = 0;
+        // a tail for a block that was already written is stale
+        if (file.read((uint8_t *)&b, sizeof(b)) == sizeof(b) && b == blocks) {
+            while (tail_count < ARCHIVE_BLOCK && file.read((uint8_t *)&tail[tail_count], sizeof(ArchiveRow)) == sizeof(ArchiveRow)) {
+                tail_count++;
+            }
+        }
+        file.close();
+    }
+    if (tail_count == ARCHIVE_BLOCK) {
+        flush();
+    }
+}
+
+// call handler for each matching row dealt in [since, until], oldest
+// first, until it returns false. Reads up to nblocks blocks, true when
+// the query is done.
+bool Archive::query(ArchiveQuery &q, Handler handler, void *arg, int nblocks)
+{
+    if (q.done) {
+        return true;
+    }
+    const DealConstraint &c = q.c;
+    q.stats.blocks = blocks;
+    bool more = true;
+    if (q.block < blocks) {
+        File index = LittleFS.open(ARCHIVE_INDEX, FILE_READ);
+        File data = LittleFS.open(ARCHIVE_FILE, FILE_READ);
+        if (!index || !data || !index.seek(q.block * sizeof(ArchiveIndex))) {
+            q.block = blocks;
+        }
+        ArchiveIndex ix;
+        uint8_t hcp[NPLAYERS][ARCHIVE_BLOCK];
+        uint16_t shape[NPLAYERS][ARCHIVE_BLOCK];
+        uint32_t tm[ARCHIVE_BLOCK];
+        for (int n = 0 ; more && n < nblocks && q.block < blocks ; n++) {
+            unsigned long b = q.block++;
+            if (index.read((uint8_t *)&ix, sizeof(ix)) != sizeof(ix)) {
+                q.block = blocks;
+                break;
+            }
+            if (ix.time_max < q.since || ix.time_min > q.until || !ix.may_match(c)) {
+                continue;
+            }
+            // the time, hcp and shape columns, then the rest only for matches
+            uint32_t base = b * sizeof(ArchiveBlock);
+            data.seek(base + offsetof(ArchiveBlock, time));
+            data.read((uint8_t *)tm, sizeof(tm));
+            data.seek(base + offsetof(ArchiveBlock, hcp));
+            data.read((uint8_t *)hcp, sizeof(hcp));
+            data.read((uint8_t *)shape, sizeof(shape));
+            q.stats.scanned++;
+            for (int i = 0 ; more && i < ix.count ; i++) {
+                q.stats.rows++;
+                uint8_t h[NPLAYERS] = {hcp[0][i], hcp[1][i], hcp[2][i], hcp[3][i]};
+                uint16_t s[NPLAYERS] = {shape[0][i], shape[1][i], shape[2][i], shape[3][i]};
+                if (tm[i] < q.since || tm[i] > q.until || !archive_match(c, h, s)) {
+                    continue;
+                }
+                ArchiveRow row;
+                data.seek(base + offsetof(ArchiveBlock, id) + i * sizeof(row.id.w));
+                data.read((uint8_t *)row.id.w, sizeof(row.id.w));
+                if (!archive_match_fixed(c, row.id)) {
+                    continue;
+                }
+                row.time = tm[i];
+                data.seek(base + offsetof(ArchiveBlock, board) + i * sizeof(row.board));
+                data.read((uint8_t *)&row.board, sizeof(row.board));
+                data.seek(base + offsetof(ArchiveBlock, dealer) + i);
+                data.read(&row.dealer, 1);
+                data.seek(base + offsetof(ArchiveBlock, machine) + i);
+                data.read(&row.machine, 1);
+                memcpy(row.hcp, h, sizeof(h));
+                memcpy(row.shape, s, sizeof(s));
+                q.stats.matches++;
+                more = handler(row, arg);
+            }
+        }
+        index.close();
+        data.close();
+        if (more && q.block < blocks) {
+            return false;
+        }
+    }
+    for (int i = 0 ; more && i < tail_count ; i++) {
+        q.stats.rows++;
+        const ArchiveRow &row = tail[i];
+        if (row.time >= q.since && row.time <= q.until && archive_match(c, row.hcp, row.shape) && archive_match_fixed(c, row.id)) {
+            q.stats.matches++;
+            more = handler(row, arg);
+        }
+    }
+    q.done = true;
+    return true;
+}
+
+//
+// GET /archive?q=<constraint>&since=&until=&limit=, the query state
+// is kept in http.buf and a few blocks are read per step.
+//
+struct ArchivePrint {
+    ArchiveQuery q;
+    HTTP *http;
+    int limit;
+    unsigned long tm;
+};
+
+static bool print_row(const ArchiveRow &row, void *arg)
+{
+    ArchivePrint *p = (ArchivePrint *)arg;
+    Bitboard bits;
+    Deal deal;
+    char id[DEAL_ID_TEXTLEN], text[DEAL_TEXTLEN];
+    row.id.format(id);
+    row.id.decode(bits);
+    bits.dealer = row.dealer;
+    if (!bits.to(deal)) {
+        // a damaged row
+        return true;
+    }
+    deal.format(text);
+    p->http->printf("%lu %d %s ", (unsigned long)row.time, row.board == ARCHIVE_NOBOARD ? 0 : row.board + 1, id);
+    p->http->printf("%s\n", text);
+    return --p->limit > 0;
+}
+
+static bool archive_step(HTTP &http)
+{
+    ArchivePrint *p = (ArchivePrint *)http.buf.get();
+    TASK_BEGIN(http.task);
+    http.buf = std::shared_ptr<unsigned char[]>(new unsigned char[sizeof(ArchivePrint)]);
+    p = new (http.buf.get()) ArchivePrint();
+    if (!p->q.c.parse(http.param["q"].c_str())) {
+        http.header(400, "Invalid Query");
+        http.close();
+        http.buf = NULL;
+        TASK_EXIT(http.task);
+    }
+    p->q.since = http.param.count("since") ? strtoul(http.param["since"].c_str(), NULL, 10) : 0;
+    p->q.until = http.param.count("until") ? strtoul(http.param["until"].c_str(), NULL, 10) : 0xFFFFFFFF;
+    p->http = &http;
+    p->limit = http.param.count("limit") ? atoi(http.param["limit"].c_str()) : 20;
+    p->tm = millis();
+    http.header(200, "Archive");
+    http.printf("Content-Type: text/plain\n");
+    http.body();
+    while (p->limit > 0 && !::archive.query(p->q, print_row, p)) {
+        http.http_tm = millis();
+        TASK_YIELD(http.task);
+    }
+    http.printf("%lu matches, %lu of %lu blocks read, %lu rows, %lums\n", p->q.stats.matches, p->q.stats.scanned, p->q.stats.blocks, p->q.stats.rows, millis() - p->tm);
+    http.close();
+    http.buf = NULL;
+    TASK_END(http.task);
+}
+
+void Archive::init()
+{
+#ifdef ARDUINO
+    machine = ESP.getEfuseMac() & 0xFF;
+#endif
+    load();
+    dprintf("archive: %lu boards in %lu blocks", count(), blocks);
+    WebServer::add("/archive", [](HTTP &http) {
+      archive_step(http);
+    });
+}
@@ -0,0 +1,107 @@
+// (c)2024, Arthur van Hoff, Artfahrt Inc.
+#pragma once
+#include "util.h"
+#include "deal.h"
+#include "generate.h"
+
+#define ARCHIVE_FILE        "/archive.dat"  // full blocks, column by column
+#define ARCHIVE_INDEX       "/archive.idx"  // min/max of each block
+#define ARCHIVE_TAIL        "/archive.tail" // rows of the block being filled
+#define ARCHIVE_BLOCK       64              // rows per block
+#define ARCHIVE_NOBOARD     0xFFFF
+#define ARCHIVE_STEP_BLOCKS 4               // blocks read per step of a query
+#define ARCHIVE_CLOCK_SET   1700000000      // earlier times are from a clock that was never set
+
+//
+// One dealt board, the deal as a DealId plus columns to query on.
+//
+struct ArchiveRow {
+    DealId id;
+    uint32_t time;                  // seconds, time(NULL), 0 if the clock was not set
+    uint16_t board;                 // board in the queue, or ARCHIVE_NOBOARD
+    uint8_t dealer;
+    uint8_t machine;
+    uint8_t hcp[NPLAYERS];
+    uint16_t shape[NPLAYERS];       // see hand_shape
+};
+
+//
+// A block of rows stored by column, so a query reads only the columns
+// it needs. Blocks are fixed size and little endian, so a host can map
+// the archive file and index it as an array.
+//
+struct ArchiveBlock {
+    uint32_t id[ARCHIVE_BLOCK][3];
+    uint32_t time[ARCHIVE_BLOCK];
+    uint16_t board[ARCHIVE_BLOCK];
+    uint8_t dealer[ARCHIVE_BLOCK];
+    uint8_t machine[ARCHIVE_BLOCK];
+    uint8_t hcp[NPLAYERS][ARCHIVE_BLOCK];
+    uint16_t shape[NPLAYERS][ARCHIVE_BLOCK];
+};
+
+struct ArchiveIndex {
+    uint32_t time_min;
+    uint32_t time_max;
+    uint8_t hcp_min[NPLAYERS];
+    uint8_t hcp_max[NPLAYERS];
+    uint8_t len_min[NPLAYERS][NSUITS];
+    uint8_t len_max[NPLAYERS][NSUITS];
+    uint8_t short_max[NPLAYERS];    // longest shortest suit, for balanced
+    uint8_t count;
+    uint8_t pad[3];
+
+    void clear();
+    void add(const ArchiveRow &row);
+    bool may_match(const DealConstraint &c) const;
+};
+
+struct ArchiveStats {
+    unsigned long blocks = 0;       // blocks in the archive
+    unsigned long scanned = 0;      // blocks read
+    unsigned long rows = 0;         // rows checked
+    unsigned long matches = 0;
+};
+
+//
+// A query in progress. Each step reads a few blocks, the rows in the
+// tail are checked after the last block.
+//
+struct ArchiveQuery {
+    DealConstraint c;
+    uint32_t since = 0;
+    uint32_t until = 0xFFFFFFFF;
+    unsigned long block = 0;        // next block to read
+    bool done = false;
+    ArchiveStats stats;
+};
+
+//
+// Append-only archive of dealt boards. Rows collect in a small tail
+// file until a block is full, then the block is written and its index
+// entry is appended; the index is what commits a block.
+//
+class Archive : public InitComponent {
+  public:
+    typedef bool (*Handler)(const ArchiveRow &row, void *arg);
+    unsigned long blocks = 0;
+    ArchiveRow tail[ARCHIVE_BLOCK];
+    int tail_count = 0;
+    uint8_t machine = 0;
+
+  public:
+    Archive() : InitComponent("Archive") {}
+    virtual void init();
+
+    bool add(const Deal &deal, int board);
+    unsigned long count() { return blocks * ARCHIVE_BLOCK + tail_count; }
+    bool query(ArchiveQuery &q, Handler handler, void *arg, int nblocks = ARCHIVE_STEP_BLOCKS);
+
+  private:
+    bool flush();
+    void load();
+};
+
+extern Archive archive;
+extern bool archive_match(const DealConstraint &c, const uint8_t *hcp, const uint16_t *shape);
+extern bool archive_match_fixed(const DealConstraint &c, const DealId &id);
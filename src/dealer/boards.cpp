@@ -0,0 +1,399 @@
+// (c)2024, Arthur van Hoff, Artfahrt Inc.
+#include "boards.h"
+#include "webserver.h"
+#include "generate.h"
+#include <LittleFS.h>
+
+const char *boards_state_name(int state)
+{
+    switch (state) {
+      case BOARDS_STOPPED: return "stopped";
+      case BOARDS_WAITING: return "waiting";
+      case BOARDS_DEALING: return "dealing";
+      case BOARDS_PAUSED: return "paused";
+      case BOARDS_DONE: return "done";
+      default: return "unknown";
+    }
+}
+
+static bool count_board(DealReader &reader, Deal &deal, void *arg)
+{
+    return true;
+}
+
+// count the boards in the file, any format the DealReader accepts
+int BoardQueue::scan()
+{
+    count = 0;
+    File file = LittleFS.open(BOARDS_FILE, FILE_READ);
+    if (!file) {
+        return 0;
+    }
+    DealReader reader(count_board);
+    count = reader.read(file);
+    file.close();
+    if (reader.errors > 0) {
+        dprintf("boards: skipped %lu invalid deals in %s", reader.errors, BOARDS_FILE);
+    }
+    return count;
+}
+
+struct BoardFind {
+    int index;
+    Deal *deal;
+};
+
+static bool find_board(DealReader &reader, Deal &deal, void *arg)
+{
+    BoardFind *find = (BoardFind *)arg;
+    if ((int)reader.deals - 1 < find->index) {
+        return true;
+    }
+    *find->deal = deal;
+    return false;
+}
+
+bool BoardQueue::get(int index, Deal &deal)
+{
+    File file = LittleFS.open(BOARDS_FILE, FILE_READ);
+    if (!file) {
+        dprintf("boards: failed to open %s", BOARDS_FILE);
+        return false;
+    }
+    BoardFind find = {index, &deal};
+    DealReader reader(find_board, &find);
+    reader.read(file);
+    file.close();
+    if (!reader.stopped) {
+        dprintf("boards: board %d not found", index + 1);
+        return false;
+    }
+    return true;
+}
+
+//
+// PUT /boards, a deal list, PBN or LIN file of any size. The body is
+// parsed as it arrives and the deals are stored one per line.
+//
+static DealReader upload_reader(NULL);
+
+// one upload or generate at a time, they share BOARDS_FILE. The server
+// drops a request after 2s without progress without telling the handler.
+static bool writing = false;
+static unsigned long writing_tm = 0;
+#define WRITING_STALE   2500
+
+static bool boards_busy(HTTP &http)
+{
+    if (writing && long(millis() - writing_tm) < WRITING_STALE) {
+        http.header(409, "Boards Being Written");
+        http.close();
+        return true;
+    }
+    return false;
+}
+
+static bool upload_board(DealReader &reader, Deal &deal, void *arg)
+{
+    File *file = (File *)arg;
+    file->print(reader.text);
+    file->print("\n");
+    return true;
+}
+
+static bool upload_step(HTTP &http)
+{
+    TASK_BEGIN(http.task);
+    if (http.method != "PUT") {
+        http.header(405, "Method Not Allowed");
+        http.close();
+        TASK_EXIT(http.task);
+    }
+    http.content_length = http.hdrs.count("content-length") ? atoi(http.hdrs["content-length"].c_str()) : -1;
+    if (http.content_length < 0) {
+        http.header(411, "Length Required");
+        http.close();
+        TASK_EXIT(http.task);
+    }
+    if (::boards.state == BOARDS_DEALING) {
+        http.header(409, "Dealing");
+        http.close();
+        TASK_EXIT(http.task);
+    }
+    if (boards_busy(http)) {
+        TASK_EXIT(http.task);
+    }
+    http.file = LittleFS.open(BOARDS_FILE, FILE_WRITE);
+    if (!http.file) {
+        http.header(404, "File Not Write");
+        http.close();
+        TASK_EXIT(http.task);
+    }
+    writing = true;
+    writing_tm = millis();
+    upload_reader.reset();
+    upload_reader.handler = upload_board;
+    upload_reader.arg = &http.file;
+
+    if (http.hdrs.count("expect") && http.hdrs["expect"] == "100-continue") {
+        http.client.println("HTTP/1.1 100 Continue");
+        http.client.println("");
+        http.client.flush();
+    }
+
+    for (http.bytes = 0 ; http.bytes < http.content_length ; ) {
+        TASK_WAIT_UNTIL(http.task, http.client.available() > 0 || !http.client.connected());
+        if (!http.client.connected()) {
+            dprintf("boards: lost connection during upload");
+            writing = false;
+            http.file.close();
+            http.close();
+            TASK_EXIT(http.task);
+        }
+        {
+            char buf[DEAL_READER_BUFLEN];
+            int n = http.client.readBytes(buf, min((long)sizeof(buf), min(http.content_length - http.bytes, (long)http.client.available())));
+            upload_reader.feed(buf, n);
+            http.bytes += n;
+            http.http_tm = millis();
+            writing_tm = http.http_tm;
+        }
+    }
+    upload_reader.finish();
+    http.file.close();
+    writing = false;
+
+    ::boards.stop();
+    ::boards.scan();
+    dprintf("boards: uploaded %d boards, %lu invalid", ::boards.count, upload_reader.errors);
+    http.header(201, "Boards Created");
+    http.printf("Content-Type: text/plain\n");
+    http.body();
+    http.printf("%d boards, %lu invalid\n", ::boards.count, upload_reader.errors);
+    http.close();
+    TASK_END(http.task);
+}
+
+bool BoardQueue::start(int first)
+{
+    if (scan() == 0 || first < 0 || first >= count) {
+        dprintf("boards: nothing to deal, %d boards", count);
+        return false;
+    }
+    if (first == 0) {
+        memset(results, 0, sizeof(results));
+    }
+    next = first;
+    state = BOARDS_WAITING;
+    poll_tm = 0;
+    dprintf("boards: starting at board %d of %d", next + 1, count);
+    save();
+    return true;
+}
+
+void BoardQueue::stop()
+{
+    state = BOARDS_STOPPED;
+    save();
+}
+
+// time to try the next board
+bool BoardQueue::ready(unsigned long now)
+{
+    if (state != BOARDS_WAITING || now < poll_tm + BOARDS_POLL) {
+        return false;
+    }
+    poll_tm = now;
+    return true;
+}
+
+// the hopper was still empty
+void BoardQueue::waiting()
+{
+    state = BOARDS_WAITING;
+}
+
+void BoardQueue::dealing()
+{
+    state = BOARDS_DEALING;
+}
+
+void BoardQueue::done(int cards, unsigned long ms)
+{
+    if (next < BOARDS_MAX) {
+        results[next].ms = ms;
+        results[next].cards = cards;
+    }
+    dprintf("boards: board %d done, %d cards in %lums", next + 1, cards, ms);
+    next += 1;
+    state = next < count ? BOARDS_WAITING : BOARDS_DONE;
+    poll_tm = millis();
+    save();
+}
+
+void BoardQueue::failed()
+{
+    state = BOARDS_PAUSED;
+    save();
+}
+
+
+void BoardQueue::save()
+{
+    File file = LittleFS.open(BOARDS_STATE, FILE_WRITE);
+    if (!file) {
+        dprintf("error: failed to open for write: %s", BOARDS_STATE);
+        return;
+    }
+    int hdr[3] = {BOARDS_VERSION, state, next};
+    file.write((const uint8_t *)hdr, sizeof(hdr));
+    file.write((const uint8_t *)results, sizeof(results));
+    file.close();
+}
+
+bool BoardQueue::load()
+{
+    File file = LittleFS.open(BOARDS_STATE, FILE_READ);
+    if (!file) {
+        return false;
+    }
+    int hdr[3];
+    bool ok = file.read((uint8_t *)hdr, sizeof(hdr)) == sizeof(hdr) && hdr[0] == BOARDS_VERSION &&
+              file.read((uint8_t *)results, sizeof(results)) == sizeof(results);
+    file.close();
+    if (!ok) {
+        memset(results, 0, sizeof(results));
+        return false;
+    }
+    state = hdr[1];
+    next = hdr[2];
+    // a board that was being dealt can be resumed
+    if (state == BOARDS_DEALING) {
+        state = BOARDS_PAUSED;
+    }
+    scan();
+    dprintf("boards: %s at board %d of %d", boards_state_name(state), next + 1, count);
+    return true;
+}
+
+//
+// GET /boards?gen=<constraint>&count=<n>&seed=<s>, a set of random boards
+// matching a constraint, see DealConstraint. At most GEN_STEP_TRIES
+// deals are tried per step, the dealer rotates with the board number.
+//
+static DealGenerator board_gen;
+static bool board_found;
+
+static bool generate_step(HTTP &http)
+{
+    TASK_BEGIN(http.task);
+    if (::boards.state == BOARDS_DEALING) {
+        http.header(409, "Dealing");
+        http.close();
+        TASK_EXIT(http.task);
+    }
+    if (boards_busy(http)) {
+        TASK_EXIT(http.task);
+    }
+    board_gen.seed = http.param.count("seed") ? strtoull(http.param["seed"].c_str(), NULL, 10) : esp_random();
+    board_gen.tries = 0;
+    board_gen.found = 0;
+    http.content_length = http.param.count("count") ? atoi(http.param["count"].c_str()) : 16;
+    if (!board_gen.constraint.parse(http.param["gen"].c_str()) || http.content_length <= 0) {
+        http.header(400, "Invalid Constraint");
+        http.close();
+        TASK_EXIT(http.task);
+    }
+    http.file = LittleFS.open(BOARDS_FILE, FILE_WRITE);
+    if (!http.file) {
+        http.header(404, "File Not Write");
+        http.close();
+        TASK_EXIT(http.task);
+    }
+    writing = true;
+    for (http.bytes = 0 ; http.bytes < http.content_length ; http.bytes++) {
+        board_gen.start(http.bytes);
+        for (;;) {
+            {
+                Bitboard bits;
+                Deal deal;
+                char text[DEAL_TEXTLEN];
+                bits.dealer = http.bytes % NPLAYERS;
+                int r = board_gen.next(bits);
+                board_found = r == GEN_FOUND && bits.to(deal);
+                if (board_found) {
+                    deal.format(text);
+                    http.file.print(text);
+                    http.file.print("\n");
+                }
+                http.http_tm = millis();
+                writing_tm = http.http_tm;
+                if (r != GEN_MORE) {
+                    break;
+                }
+            }
+            TASK_YIELD(http.task);
+        }
+        if (!board_found) {
+            break;
+        }
+        TASK_YIELD(http.task);
+    }
+    http.file.close();
+    writing = false;
+
+    ::boards.stop();
+    ::boards.scan();
+    dprintf("boards: generated %d boards, %lu tries", ::boards.count, board_gen.tries);
+    if (http.bytes < http.content_length) {
+        http.header(422, "Boards Not Generated");
+        http.printf("Content-Type: text/plain\n");
+        http.body();
+        http.printf("%d of %ld boards, no deal found in %d tries, seed %llu\n", ::boards.count, http.content_length, GEN_MAX_TRIES, board_gen.seed);
+        http.close();
+        TASK_EXIT(http.task);
+    }
+    http.header(201, "Boards Created");
+    http.printf("Content-Type: text/plain\n");
+    http.body();
+    http.printf("%d boards, seed %llu, %lu tries\n", ::boards.count, board_gen.seed, board_gen.tries);
+    http.close();
+    TASK_END(http.task);
+}
+
+void BoardQueue::init()
+{
+    load();
+    WebServer::add("/boards", [](HTTP &http) {
+      if (http.method == "GET" && http.param.count("gen")) {
+        generate_step(http);
+      } else {
+        upload_step(http);
+      }
+    });
+    WebServer::add("/queue", [](HTTP &http) {
+      if (http.param.count("start")) {
+        ::boards.start(max(0, atoi(http.param["start"].c_str()) - 1));
+      } else if (http.param["stop"] == "1") {
+        ::boards.stop();
+      }
+      http.header(200, "Board Queue");
+      http.printf("Content-Type: text/plain\n");
+      http.body();
+      http.printf("%s, board %d of %d\n", boards_state_name(::boards.state), ::boards.next + 1, ::boards.count);
+      unsigned long total = 0;
+      int dealt = 0;
+      for (int i = 0 ; i < ::boards.count && i < BOARDS_MAX ; i++) {
+        BoardResult &r = ::boards.results[i];
+        if (r.cards > 0) {
+          http.printf("board %2d: %2d cards in %5.1fs%s\n", i + 1, r.cards, r.ms / 1000.0f, r.cards < DECKLEN ? " (SHORT)" : "");
+          total += r.ms;
+          dealt++;
+        }
+      }
+      if (dealt > 0) {
+        http.printf("%d boards in %.1fs, %.1fs/board\n", dealt, total / 1000.0f, total / 1000.0f / dealt);
+      }
+      http.close();
+    });
+}
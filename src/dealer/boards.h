@@ -0,0 +1,56 @@
+// (c)2024, Arthur van Hoff, Artfahrt Inc.
+#pragma once
+#include "util.h"
+#include "deal.h"
+
+#define BOARDS_FILE         "/boards.txt"   // deal list, PBN or LIN, see DealReader
+#define BOARDS_STATE        "/boards.cfg"   // progress through the boards
+#define BOARDS_VERSION      1
+#define BOARDS_MAX          64              // boards with timing
+#define BOARDS_POLL         2000            // ms, check for a reloaded hopper
+
+enum BoardsState {
+    BOARDS_STOPPED,
+    BOARDS_WAITING,                 // for the hopper to be (re)loaded
+    BOARDS_DEALING,
+    BOARDS_PAUSED,                  // deal failed, use /resume
+    BOARDS_DONE,
+};
+
+struct BoardResult {
+    uint32_t ms;                    // time to deal the board
+    uint8_t cards;                  // cards dealt
+};
+
+//
+// A set of boards dealt back to back. The boards are uploaded once, the
+// next board starts when the hopper is reloaded. Progress is kept in
+// flash, so a set can be continued after a reboot.
+//
+class BoardQueue : public InitComponent {
+  public:
+    int state = BOARDS_STOPPED;
+    int count = 0;                  // boards in the file
+    int next = 0;                   // board being dealt, or to be dealt next
+    BoardResult results[BOARDS_MAX];
+    unsigned long poll_tm = 0;
+
+  public:
+    BoardQueue() : InitComponent("Boards") {}
+    virtual void init();
+
+    bool start(int first = 0);
+    void stop();
+    bool get(int index, Deal &deal);
+    bool ready(unsigned long now);
+    void waiting();
+    void dealing();
+    void done(int cards, unsigned long ms);
+    void failed();
+    int scan();
+    void save();
+    bool load();
+};
+
+extern BoardQueue boards;
+extern const char *boards_state_name(int state);
@@ -3,69 +3,112 @@
 #include "eject.h"
 #include "bus.h"
 #include "deal.h"
+#include "webserver.h"
+#include "event.h"
+#include "trace.h"
+#include <LittleFS.h>
 
 extern BusMaster bus;
+extern Ejector ejector;
+
+static const EjectTiming defaults = EjectTiming();
+
+void Ejector::set_state(EjectState s)
+{
+    if (s != state) {
+        if (s == EJECT_FAILED) {
+            failed_state = state;
+        }
+        state = s;
+        events.post(EV_EJECT_STATE, s);
+    }
+}
 
 bool Ejector::captureCard()
 {
-    delay(200);
     //dprintf("captureCard learning=%d", learning);
     current_card = CARD_NULL;
-    unsigned char buf[] = {CMD_CAPTURE};
-    return bus.request(CAMERA_ADDR, buf, sizeof(buf));
+    if (++trace_id == 0) {
+        trace_id = 1;
+    }
+    current_trace = trace_id;
+    capture_us = micros();
+    unsigned char buf[] = {CMD_CAPTURE, (unsigned char)current_trace, (unsigned char)(current_trace >> 8)};
+    cycle.mark(MARK_CAPTURE, millis());
+    return bus.request(BUS_ROLE_CAMERA, buf, sizeof(buf));
 }
 
-bool Ejector::identifyCard(int timeout)
+// poll the camera, true when the current card is known
+bool Ejector::identifyCard()
 {
     switch (current_card) {
-      case CARD_FAIL:
-      case CARD_USED:
-      case CARD_EMPTY:
-        return true;
-      case CARD_NULL:
-        for (unsigned long start_tm = millis() ;;) {
-            unsigned char buf[1] = {CARD_FAIL};
-            if (!bus.request(CAMERA_ADDR, (const unsigned char []){CMD_IDENTIFY}, 1, buf, 1)) {
+      case CARD_NULL: {
+        unsigned char buf[1] = {CARD_FAIL};
+        unsigned char req[] = {CMD_IDENTIFY, (unsigned char)current_trace, (unsigned char)(current_trace >> 8)};
+        if (!bus.request(BUS_ROLE_CAMERA, req, sizeof(req), buf, 1)) {
+            current_card = CARD_FAIL;
+            dprintf("identifyCard: failed");
+            return false;
+        }
+        current_card = buf[0];
+        switch (current_card) {
+          case CARD_NULL:
+            return false;
+          case CARD_FAIL:
+          case CARD_EMPTY:
+            break;
+          default:
+            if (current_card < 0 || current_card >= DECKLEN) {
+                dprintf("identifyCard: got invalid card %d", current_card);
                 current_card = CARD_FAIL;
-                dprintf("identifyCard: failed");
-                return false;
-            }
-            current_card = buf[0];
-            if (current_card != CARD_NULL) {
-                switch(current_card) {
-                case CARD_FAIL:
-                case CARD_EMPTY:
-                    break;
-                default:
-                    if (current_card < 0 || current_card >= DECKLEN) {
-                        dprintf("identifyCard: got invalid card %d", current_card);
-                        current_card = CARD_FAIL;
-                    }
-                    break;
-                }
-                dprintf("identifyCard: card=%d, %s", current_card, full_name(current_card));
-                return true;
             }
-            if (timeout == 0) {
-                return false;
-            }
-            if (millis() > start_tm + timeout) {
-                dprintf("identifyCard: timeout=%d, CARD_FAIL", timeout);
-                break;
-            }
-            delay(1);
-            //dprintf("ident: got current_card=%d", current_card);
+            break;
         }
-        current_card = CARD_FAIL;
-        dprintf("identifyCard: timeout, CARD_FAIL");
-        return false;
+        dprintf("identifyCard: card=%d, %s", current_card, full_name(current_card));
+        cycle.mark(MARK_IDENTIFIED, millis());
+        tracer.add(SPAN_IDENTIFY, current_trace, capture_us, micros());
+        events.post(EV_CARD_IDENTIFIED, current_card);
+        return true;
+      }
       default:
         return true;
     }
 }
 
+// resumable, wait for the card to settle, capture it, and wait until it is identified
+bool Ejector::capture_step()
+{
+    TASK_BEGIN(task);
+    TASK_DELAY(task, 200);
+    if (!captureCard()) {
+        dprintf("capture: failed to capture card");
+        current_card = CARD_FAIL;
+        identified = false;
+        TASK_EXIT(task);
+    }
+    identified = false;
+    TASK_WAIT_UNTIL_TIMEOUT(task, (identified = identifyCard()) || current_card == CARD_FAIL, EJECT_IDENTIFY_TIMEOUT);
+    if (current_card == CARD_NULL) {
+        dprintf("identifyCard: timeout=%d, CARD_FAIL", EJECT_IDENTIFY_TIMEOUT);
+        current_card = CARD_FAIL;
+    }
+    TASK_END(task);
+}
+
+// resumable, stop the motors after the finish window and capture the next card
+bool Ejector::finish_step()
+{
+    TASK_BEGIN(task);
+    TASK_WAIT_UNTIL(task, long(millis() - (eject_tm + timing.finish)) > 0);
+    motor1.stop();
+    motor2.stop();
+    TASK_DELAY(task, 200);
+    captureCard();
+    TASK_END(task);
+}
 
-bool Ejector::load(bool learn)
+// start capturing and identifying, the motors start in idle once the card is known
+bool Ejector::load(bool learn, bool clear)
 {
     if (card.state) {
         dprintf("load: failed, card already loaded");
@@ -74,39 +117,39 @@ bool Ejector::load(bool learn)
 
     // reset card state on camera
     unsigned char buf[] = {CMD_CLEAR, (unsigned char)(learn ? 1 : 0) };
-    if (!bus.request(CAMERA_ADDR, buf, sizeof(buf), NULL, 0)) {
+    if (clear && !bus.request(BUS_ROLE_CAMERA, buf, sizeof(buf), NULL, 0)) {
         dprintf("load: failed to clear cards");
         return false;
     }
-    if (!captureCard()) {
-        dprintf("load: failed to capture card");
-        return false;
-    }
 
     dprintf(learn ? "load and learn" : "load");
+    current_card = CARD_NULL;
     loaded_card = CARD_NULL;
-    if (!identifyCard()) {
-        dprintf("load: failed to identify card");
-        return false;
-    }
-    if (current_card == CARD_EMPTY) {
-        dprintf("load: hopper empty");
-        return false;
-    }
-
-    state = EJECT_LOADING;
     learning = learn;
+    cycle.clear();
+    task.restart();
+    set_state(EJECT_CAPTURING);
+    return true;
+}
+
+void Ejector::start_loading(unsigned long now)
+{
+    set_state(EJECT_LOADING);
     motor1.stop();
     motor2.stop();
 
     motor1.set_speed(speed);
     motor2.set_speed(speed);
     card_tm = card.last_tm;
-    eject_tm = millis();
-    return true;
+    eject_tm = now;
+    load_us = micros();
+    card.feeding(IR_FEED_LOAD);
+    cycle.mark(MARK_LOAD, now);
 }
 
-bool Ejector::eject()
+// eject once the next card is identified, this may take a while after a capture,
+// an eager eject does not wait, the card is identified while it is being loaded
+bool Ejector::eject(bool eager)
 {
     if (!card.state) {
         dprintf("eject: failed no card loaded");
@@ -114,12 +157,27 @@ bool Ejector::eject()
     }
 
     dprintf(learning ? "eject and learn" : "eject");
-    if (!identifyCard()) {
+    if (identifyCard()) {
+        start_ejecting(millis());
+        return true;
+    }
+    if (current_card == CARD_FAIL) {
         dprintf("eject: failed to identify card");
         return false;
     }
+    // not identified yet, keep polling in idle
+    task.wait_tm = millis() + EJECT_IDENTIFY_TIMEOUT;
+    if (eager) {
+        start_ejecting(millis());
+        return true;
+    }
+    set_state(EJECT_IDENTIFYING);
+    return true;
+}
 
-    state = EJECT_EJECTING;
+void Ejector::start_ejecting(unsigned long now)
+{
+    set_state(EJECT_EJECTING);
     loaded_card = CARD_NULL;
     motor1.stop();
     motor2.stop();
@@ -127,72 +185,255 @@ bool Ejector::eject()
     motor2.set_speed(speed);
 
     card_tm = card.last_tm;
-    eject_tm = millis();
+    eject_tm = now;
+    eject_us = micros();
+    card.feeding(IR_FEED_EJECT);
     //dprintf("eject: starting eject");
-    return true;
 }
 
 void Ejector::idle(unsigned long now)
 {
     switch (state) {
+      case EJECT_CAPTURING:
+        if (!capture_step()) {
+            break;
+        }
+        if (!identified) {
+            dprintf("load: failed to identify card");
+            set_state(EJECT_FAILED);
+        } else if (current_card == CARD_EMPTY) {
+            dprintf("load: hopper empty");
+            loaded_card = CARD_EMPTY;
+            set_state(EJECT_OK);
+        } else {
+            start_loading(now);
+        }
+        break;
+      case EJECT_IDENTIFYING:
+        if (identifyCard()) {
+            start_ejecting(now);
+        } else if (TASK_TIMEDOUT(task) || current_card == CARD_FAIL) {
+            dprintf("eject: failed to identify card");
+            current_card = CARD_FAIL;
+            set_state(EJECT_FAILED);
+        }
+        break;
       case EJECT_EJECTING:
+        identifyCard();
         if (!card.state || card.last_tm != card_tm) {
+            if (tuning && card.last_tm >= eject_tm) {
+                tune_edge(timing.eject_edge, timing.eject_abort, defaults.eject_abort, card.last_tm - eject_tm);
+            }
             motor1.set_speed(speed);
             motor2.set_speed(speed);
             card_tm = card.last_tm;
-            state = EJECT_LOADING;
+            set_state(EJECT_LOADING);
             card_tm = card.last_tm;
             eject_tm = now;
+            // the next cycle starts when the card has left
+            load_us = micros();
+            tracer.add(SPAN_EJECT, loaded_trace, eject_us, load_us);
+            cycle.mark(MARK_EJECTED, now);
+            metrics.add(cycle);
+            cycle.clear();
+            cycle.mark(MARK_LOAD, now);
             //dprintf("loading after eject");
-        } else if (now > eject_tm + 500) {
-            state = EJECT_FAILED;
+        } else if (now > eject_tm + timing.eject_abort) {
+            set_state(EJECT_FAILED);
             motor1.stop();
             motor2.stop();
+            card.feeding(IR_FEED_NONE);
             dprintf("eject aborted, card=%d", card.state);
+            tune_failed(timing.eject_edge, timing.eject_abort, defaults.eject_abort);
         }
         break;
       case EJECT_LOADING:
-        if (card.state && now > card.last_tm + 70) {
+        identifyCard();
+        if (card.state && now > card.last_tm + timing.settle && current_card == CARD_NULL && !TASK_TIMEDOUT(task)) {
+            // after an eager eject, hold the card until it is identified
+            motor1.stop();
+            motor2.stop();
+        } else if (card.state && now > card.last_tm + timing.settle && (current_card == CARD_NULL || current_card == CARD_FAIL)) {
+            set_state(EJECT_FAILED);
+            motor1.stop();
+            motor2.stop();
+            card.feeding(IR_FEED_NONE);
+            dprintf("load: failed to identify card");
+            current_card = CARD_FAIL;
+        } else if (card.state && now > card.last_tm + timing.settle) {
+            if (tuning && card.last_tm >= eject_tm) {
+                tune_edge(timing.load_edge, timing.load_abort, defaults.load_abort, card.last_tm - eject_tm);
+            }
+            // the card has settled, bounces from here on are the retract's
+            card.feeding(IR_FEED_NONE);
+            if (tuning) {
+                tune_edge(timing.settle_edge, timing.settle, defaults.settle, card.settle_us / 1000.0f);
+            }
+            cycle.mark(MARK_DETECTED, card.last_tm);
+            tracer.add(SPAN_LOAD, current_trace, load_us, micros());
             motor1.reverse();
             motor2.stop();
             loaded_card = current_card;
+            loaded_trace = current_trace;
             current_card = CARD_USED;
             //dprintf("load done, retracting");
-            state = EJECT_RETRACTING;
+            set_state(EJECT_RETRACTING);
         } else if (current_card == CARD_EMPTY) {
             loaded_card = CARD_EMPTY;
             motor1.stop();
             motor2.stop();
+            card.feeding(IR_FEED_NONE);
             //dprintf("load done, empty");
-            state = EJECT_OK;
-        } else if (now > eject_tm + 1000) {
+            set_state(EJECT_OK);
+        } else if (now > eject_tm + timing.load_abort) {
             // maybe retry?
-            state = EJECT_FAILED;
+            set_state(EJECT_FAILED);
             motor1.stop();
             motor2.stop();
+            card.feeding(IR_FEED_NONE);
             dprintf("load aborted");
+            tune_failed(timing.load_edge, timing.load_abort, defaults.load_abort);
         }
         break;
       case EJECT_RETRACTING:
-        if (now > eject_tm + 100) {
+        if (now > eject_tm + timing.retract) {
             eject_tm = now;
             motor1.stop();
             motor2.stop();
-            state = EJECT_FINISH;
+            task.restart();
+            set_state(EJECT_FINISH);
             //dprintf("reversing done");
         }
         break;
       case EJECT_FINISH:
-        if (now > eject_tm + 140) {
-            state = EJECT_OK;
-            motor1.stop();
-            motor2.stop();
-            captureCard();
+        if (finish_step()) {
+            set_state(EJECT_OK);
             //dprintf("eject finish and done, current=%d, loaded=%d", current_card, loaded_card);
         }
-        // fall through
+        break;
       default:
-        identifyCard(0);
+        identifyCard();
         break;
     }
 }
+
+//
+// Timing
+//
+
+void EjectEdge::add(float ms)
+{
+    // Welford
+    count += 1;
+    float delta = ms - mean;
+    mean += delta / count;
+    m2 += delta * (ms - mean);
+    maximum = max(maximum, ms);
+}
+
+// shrink a window toward the observed edges, never beyond the default,
+// a changed window is saved so it survives a reboot
+void Ejector::tune_edge(EjectEdge &edge, int &window, int def, float ms)
+{
+    edge.add(ms);
+    if (edge.count >= EJECT_TUNE_SAMPLES) {
+        float bound = max(edge.mean + EJECT_TUNE_SIGMAS * edge.stddev(), edge.maximum) + EJECT_TUNE_MARGIN;
+        int w = max(def * EJECT_TUNE_FLOOR / 100, min(def, int(ceilf(bound))));
+        if (w != window) {
+            window = w;
+            save_timing();
+        }
+    }
+}
+
+// back off, the window goes back to its default and the edges seen so
+// far are dropped, so it is not shrunk again until EJECT_TUNE_SAMPLES
+// new edges have been seen
+void Ejector::tune_failed(EjectEdge &edge, int &window, int def)
+{
+    if (!tuning) {
+        return;
+    }
+    window = def;
+    edge = EjectEdge();
+    dprintf("eject: backing off, eject=%d, load=%d", timing.eject_abort, timing.load_abort);
+    save_timing();
+}
+
+bool Ejector::load_timing()
+{
+    File file = LittleFS.open(EJECT_TIMING_FILE, FILE_READ);
+    if (!file) {
+        return false;
+    }
+    int version = 0;
+    EjectTiming t;
+    bool ok = file.read((uint8_t *)&version, sizeof(version)) == sizeof(version) && version == EJECT_TIMING_VERSION && 
+              file.read((uint8_t *)&t, sizeof(t)) == sizeof(t);
+    file.close();
+    if (!ok) {
+        dprintf("eject: ignoring %s, wrong version or size", EJECT_TIMING_FILE);
+        return false;
+    }
+    timing = t;
+    dprintf("eject: loaded timing, settle=%d, retract=%d, finish=%d, eject=%d, load=%d", timing.settle, timing.retract, timing.finish, timing.eject_abort, timing.load_abort);
+    return true;
+}
+
+bool Ejector::save_timing()
+{
+    File file = LittleFS.open(EJECT_TIMING_FILE, FILE_WRITE);
+    if (!file) {
+        dprintf("error: failed to open for write: %s", EJECT_TIMING_FILE);
+        return false;
+    }
+    int version = EJECT_TIMING_VERSION;
+    file.write((const uint8_t *)&version, sizeof(version));
+    file.write((const uint8_t *)&timing, sizeof(timing));
+    file.close();
+    return true;
+}
+
+static void print_edge(HTTP &http, const char *name, EjectEdge &edge, int window, int def)
+{
+    http.printf("%-8s window=%4dms (default %4d), edges=%lu mean=%.1fms stddev=%.1fms max=%.0fms\n", name, window, def, edge.count, edge.mean, edge.stddev(), edge.maximum);
+}
+
+void Ejector::init()
+{
+    load_timing();
+    WebServer::add("/eject", [](HTTP &http) {
+      EjectTiming &t = ::ejector.timing;
+      for (auto i : http.param) {
+        int v = atoi(i.second.c_str());
+        if (i.first == "tune") {
+          ::ejector.tuning = v != 0;
+        } else if (i.first == "reset") {
+          t = defaults;
+          ::ejector.save_timing();
+        } else if (i.first == "save") {
+          ::ejector.save_timing();
+        } else if (i.first == "settle") {
+          t.settle = v;
+        } else if (i.first == "retract") {
+          t.retract = v;
+        } else if (i.first == "finish") {
+          t.finish = v;
+        } else if (i.first == "eject") {
+          t.eject_abort = v;
+        } else if (i.first == "load") {
+          t.load_abort = v;
+        }
+      }
+      http.header(200, "Eject Timing");
+      http.printf("Content-Type: text/plain\n");
+      http.body();
+      http.printf("tuning=%d\n", ::ejector.tuning);
+      print_edge(http, "settle", t.settle_edge, t.settle, defaults.settle);
+      http.printf("retract  window=%4dms (default %4d)\n", t.retract, defaults.retract);
+      http.printf("finish   window=%4dms (default %4d)\n", t.finish, defaults.finish);
+      print_edge(http, "eject", t.eject_edge, t.eject_abort, defaults.eject_abort);
+      print_edge(http, "load", t.load_edge, t.load_abort, defaults.load_abort);
+      http.close();
+    });
+}
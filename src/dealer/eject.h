@@ -4,9 +4,12 @@
 #include "util.h"
 #include "sensor.h"
 #include "motor.h"
+#include "metrics.h"
 
 enum EjectState {
     EJECT_IDLE,
+    EJECT_CAPTURING,
+    EJECT_IDENTIFYING,
     EJECT_RETRACTING,
     EJECT_EJECTING,
     EJECT_LOADING,
@@ -15,23 +18,87 @@ enum EjectState {
     EJECT_OK,
 };
 
+#define EJECT_IDENTIFY_TIMEOUT  1000    // ms
+
+#define EJECT_TIMING_FILE       "/eject.cfg"
+#define EJECT_TIMING_VERSION    3       // 1 had auto tuned open loop windows, 2 did not learn settle
+#define EJECT_TUNE_SAMPLES      20      // edges seen before an abort window is shrunk
+#define EJECT_TUNE_SIGMAS       4       // abort window is mean + n * stddev + margin
+#define EJECT_TUNE_MARGIN       30      // ms
+#define EJECT_TUNE_FLOOR        50      // percent of the default, never go below
+
+//
+// Running mean/variance of the time to a sensor edge, in ms.
+//
+struct EjectEdge {
+    unsigned long count = 0;
+    float mean = 0;
+    float m2 = 0;
+    float maximum = 0;
+
+    void add(float ms);
+    inline float stddev() { return count > 1 ? sqrtf(m2 / (count - 1)) : 0; }
+};
+
+//
+// Timing windows for the eject cycle, in ms. The abort windows are learned 
+// from the sensor edges and go back to their default after an abort, until
+// enough new edges are seen. Settle is learned from the time a loaded card
+// keeps bouncing on the sensor. Retract and finish have no sensor edge to
+// learn from, they are only set by hand.
+//
+struct EjectTiming {
+    int settle = 70;            // after the card is detected, until retracting
+    int retract = 100;          // from the start of loading, until the motors stop
+    int finish = 140;           // after the motors stop, until the next capture
+    int eject_abort = 500;      // card must leave the sensor within this time
+    int load_abort = 1000;      // card must reach the sensor within this time
+    EjectEdge eject_edge;
+    EjectEdge load_edge;
+    EjectEdge settle_edge;
+};
+
 class Ejector : IdleComponent {
 public:
     EjectState state;
     int speed = 800;
+    EjectTiming timing;
+    bool tuning = false;
+    Task task;
+    bool identified = false;
+    EjectState failed_state = EJECT_IDLE;   // the state that failed
     unsigned long eject_tm;
     unsigned long card_tm;
     bool learning = false;
     int current_card = CARD_NULL;
     int loaded_card = CARD_NULL;
+    CardCycle cycle;                // marks of the card being loaded or ejected
+    uint16_t trace_id = 0;          // one per captured card, see trace.h
+    uint16_t current_trace = 0;
+    uint16_t loaded_trace = 0;
+    uint32_t capture_us = 0;
+    uint32_t load_us = 0;
+    uint32_t eject_us = 0;
     
 public:
     Ejector(const char *name) : IdleComponent(name) {}
+    virtual void init();
 
     bool captureCard();
-    bool identifyCard(int timeout = 1000);
+    bool identifyCard();
 
-    bool load(bool learn = false);
-    bool eject();
+    bool load(bool learn = false, bool clear = true);
+    bool eject(bool eager = false);
     virtual void idle(unsigned long now);
+
+    bool load_timing();
+    bool save_timing();
+  private:
+    void set_state(EjectState s);
+    bool capture_step();
+    bool finish_step();
+    void start_loading(unsigned long now);
+    void start_ejecting(unsigned long now);
+    void tune_edge(EjectEdge &edge, int &window, int def, float ms);
+    void tune_failed(EjectEdge &edge, int &window, int def);
 };
\ No newline at end of file
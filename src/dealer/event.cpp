@@ -0,0 +1,89 @@
+// (c)2024, Arthur van Hoff, Artfahrt Inc.
+#include "event.h"
+#include "webserver.h"
+
+static const char *event_names[EV_NTYPES] = {
+    "none", "detected", "left", "identified", "rotated", "eject", "timeout",
+};
+
+const char *event_name(int type)
+{
+    return type >= 0 && type < EV_NTYPES ? event_names[type] : "unknown";
+}
+
+#ifdef ARDUINO
+static portMUX_TYPE event_mux = portMUX_INITIALIZER_UNLOCKED;
+#endif
+
+// safe from interrupt handlers and other tasks
+void EventQueue::post(int type, int arg)
+{
+    unsigned long us = micros();
+#ifdef ARDUINO
+    bool isr = xPortInIsrContext();
+    if (isr) {
+      portENTER_CRITICAL_ISR(&event_mux);
+    } else {
+      portENTER_CRITICAL(&event_mux);
+    }
+#endif
+    unsigned int h = head;
+    if (h - tail < EVENT_QUEUE) {
+      Event &e = queue[h % EVENT_QUEUE];
+      e.us = us;
+      e.type = type;
+      e.arg = arg;
+      head = h + 1;
+    } else {
+      overflows++;
+    }
+#ifdef ARDUINO
+    if (isr) {
+      portEXIT_CRITICAL_ISR(&event_mux);
+    } else {
+      portEXIT_CRITICAL(&event_mux);
+    }
+#endif
+    if (consumer != NULL) {
+      consumer->wake();
+    }
+}
+
+// called by the consumer only
+bool EventQueue::pop(Event &e)
+{
+    if (tail == head) {
+      return false;
+    }
+    e = queue[tail % EVENT_QUEUE];
+    tail = tail + 1;
+    log[log_count++ % EVENT_LOG] = e;
+    return true;
+}
+
+void EventQueue::clear()
+{
+    log_count = 0;
+    overflows = 0;
+}
+
+void EventQueue::init()
+{
+    WebServer::add("/events", [](HTTP &http) {
+      if (http.param["reset"] == "1") {
+        ::events.clear();
+      }
+      http.header(200, "Event Log");
+      http.printf("Content-Type: text/plain\n");
+      http.body();
+      unsigned int first = ::events.log_count > EVENT_LOG ? ::events.log_count - EVENT_LOG : 0;
+      for (unsigned int i = first ; i < ::events.log_count ; i++) {
+        Event &e = ::events.log[i % EVENT_LOG];
+        http.printf("%lu %s %d\n", e.us, event_name(e.type), e.arg);
+      }
+      if (::events.overflows > 0) {
+        http.printf("# %lu overflows\n", ::events.overflows);
+      }
+      http.close();
+    });
+}
@@ -0,0 +1,53 @@
+// (c)2024, Arthur van Hoff, Artfahrt Inc.
+#pragma once
+#include "util.h"
+
+#define EVENT_QUEUE     32          // pending events, power of two
+#define EVENT_LOG       256         // recent events kept for /events, power of two
+
+enum EventType {
+    EV_NONE,
+    EV_CARD_DETECTED,               // IR sensor, leading edge
+    EV_CARD_LEFT,                   // IR sensor, trailing edge
+    EV_CARD_IDENTIFIED,             // arg is the card
+    EV_ROTATION_REACHED,            // arg is the angle
+    EV_EJECT_STATE,                 // arg is the new EjectState
+    EV_TIMEOUT,
+    EV_NTYPES,
+};
+
+struct Event {
+    unsigned long us;
+    uint8_t type;
+    int16_t arg;
+};
+
+extern const char *event_name(int type);
+
+//
+// Events are posted from interrupt handlers, the control task, and
+// the idle loop, and consumed by a single component, which is woken
+// when an event is posted. Consumed events are kept in a log for
+// /events. The dealer still reads the ejector state when it is woken,
+// so the log is a record of what happened, not enough to replay a run.
+//
+class EventQueue : public InitComponent {
+  public:
+    Event queue[EVENT_QUEUE];
+    volatile unsigned int head = 0;
+    volatile unsigned int tail = 0;
+    unsigned long overflows = 0;
+    Event log[EVENT_LOG];
+    unsigned int log_count = 0;
+    IdleComponent *consumer = NULL;
+
+  public:
+    EventQueue() : InitComponent("Events") {}
+    virtual void init();
+
+    void post(int type, int arg = 0);
+    bool pop(Event &e);
+    void clear();
+};
+
+extern EventQueue events;
@@ -9,9 +9,26 @@
 #include "eject.h"
 #include "storage.h"
 #include "webserver.h"
+#include "control.h"
+#include "event.h"
+#include "boards.h"
+#include "generate.h"
+#include "records.h"
+#include "archive.h"
+#include "metrics.h"
+#include "trace.h"
+#include "tracing.h"
+#include <LittleFS.h>
 
 // Components
 Storage storage;
+EventQueue events;
+BoardQueue boards;
+HandRecords records;
+Archive archive;
+CardMetrics metrics;
+Tracer tracer("dealer");
+CameraTrace camera_trace;
 BusMaster bus;
 Motor motor1("Motor1", M1_PIN1, M1_PIN2, 400, 5000);
 Motor motor2("Motor2", M2_PIN1, M2_PIN2, 400, 5000);
@@ -21,6 +38,7 @@ AngleSensor angle("Angle", rotator);
 IRSensor card("Card", CARD_PIN, HIGH);
 Ejector ejector("Ejector");
 WebServer www;
+ControlLoop control("Control");  // last, so the components it steps are initialized
 
 // REMIND: Power Button
 class Button : public IdleComponent {
@@ -91,7 +109,7 @@ class Idler : IdleComponent {
     }
     virtual void idle(unsigned long now) {
       unsigned char res[6];
-      if (!bus.request(CAMERA_ADDR, (const unsigned char []){CMD_STATUS}, 1, res, sizeof(res))) {
+      if (!bus.request(BUS_ROLE_CAMERA, (const unsigned char []){CMD_STATUS}, 1, res, sizeof(res))) {
         dprintf("cam failed");
       }
 
@@ -99,6 +117,7 @@ class Idler : IdleComponent {
 
       dprintf("%5d: dealer, detect=%d, card=%d/%d, ang=%d, wifi=%d.%d.%d.%d, cam=%d,%d, camwifi=%d.%d.%d.%d", cnt, card.state, ejector.current_card, ejector.loaded_card, int(angle.value()), ip[0], ip[1], ip[2], ip[3], res[0], res[1], res[2], res[3], res[4], res[5]);
       cnt += 1;
+      IdleComponent::report();
     }
 };
 
@@ -108,6 +127,13 @@ Idler idler;
 //
 // Dealer
 //
+#define DEALER_POLL         100         // ms, events wake the dealer sooner
+#define DEALER_TIMEOUT      10000       // ms without progress
+
+#define CHECKPOINT_FILE     "/deal.ckpt"
+#define CHECKPOINT_VERSION  2
+#define CHECKPOINT_CARDS    8           // cards between checkpoints in flash
+
 enum DealerState {
   DEALER_IDLE,
   DEALER_DEALING,
@@ -117,6 +143,18 @@ enum DealerState {
 
 extern class Dealer dealer;
 
+// progress of a deal, enough to resume it
+struct DealCheckpoint {
+  int version = CHECKPOINT_VERSION;
+  int state = DEALER_IDLE;              // nothing to resume when idle
+  int deal_count = 0;
+  bool predictive = false;
+  int board = -1;                       // index in the board queue, or -1
+  Deal deal;
+  unsigned char card_count[DECKLEN];
+  unsigned char card_hist[DECKLEN];
+};
+
 
 class Dealer : public IdleComponent {
   public:
@@ -127,12 +165,53 @@ class Dealer : public IdleComponent {
     int card_count[DECKLEN];
     int card_hist[DECKLEN];
     unsigned long last_tm = 0;
+    unsigned long start_tm = 0;
+    unsigned long start_transactions = 0;
+    bool predictive = false;
+    float rotate_rate = 0.1f;             // degrees/ms, learned from rotations
+    int rotate_card = CARD_NULL;
+    unsigned long rotate_tm = 0;
+    uint32_t rotate_us = 0;
+    float rotate_distance = 0;
+    int rotate_expected[DECKLEN];
+    int rotate_actual[DECKLEN];
+    DealCheckpoint checkpoint;
+    int checkpoint_count = 0;           // cards in the flash checkpoint
+    bool queued = false;                // dealing a board from the queue
+    const char *outcome = "none";       // how the last run ended, NULL while running
   public:
-    Dealer() : IdleComponent("Dealer", 1) {
+    Dealer() : IdleComponent("Dealer", DEALER_POLL) {
     }
 
     virtual void init()
     {
+      events.consumer = this;
+      load_checkpoint();
+      www.add("/resume", [] (HTTP &http) {
+        if (card.state || dealer.state != DEALER_IDLE) {
+          http.header(404, "Invalid State, Card Present or Busy");
+          http.close();
+          return;
+        }
+        if (!dealer.resume()) {
+          http.header(404, "Resume Failed");
+          http.close();
+          return;
+        }
+        http.header(200, "Dealing Resumed");
+        http.close();
+      });
+      // /learn, /verify and /deal return once the first card is being
+      // captured, whether it was identified is reported here
+      www.add("/dealer", [] (HTTP &http) {
+        static const char *names[] = {"idle", "dealing", "learning", "verifying"};
+        http.header(200, "Dealer Status");
+        http.printf("Content-Type: text/plain\n");
+        http.body();
+        http.printf("state=%s, cards=%d, eject=%d, outcome=%s\n", names[dealer.state], dealer.deal_count, ejector.state,
+          dealer.outcome == NULL ? "running" : dealer.outcome);
+        http.close();
+      });
       www.add("/learn", [] (HTTP &http) {
         if (card.state || dealer.state != DEALER_IDLE) {
           http.header(404, "Invalid State, Card Present or Busy");
@@ -148,6 +227,7 @@ class Dealer : public IdleComponent {
         http.header(200, "Learning Started");
         http.close();
         dealer.reset(DEALER_LEARNING);
+        dealer.queued = false;
       });
       www.add("/verify", [] (HTTP &http) {
         if (card.state || dealer.state != DEALER_IDLE) {
@@ -163,21 +243,50 @@ class Dealer : public IdleComponent {
         http.header(200, "Verification Started");
         http.close();
         dealer.reset(DEALER_VERIFYING);
+        dealer.queued = false;
       });
 
       www.add("/deal", [] (HTTP &http) {
-        String cards = http.param["deal"];
-        if (!dealer.deal.parse(cards.c_str())) {
-          http.header(200, "Cards not Parsed Correctly");
+        if (card.state || dealer.state != DEALER_IDLE) {
+          http.header(404, "Invalid State, Card Present or Busy");
           http.close();
           return;
         }
-        dealer.deal.debug();
-        if (card.state || dealer.state != DEALER_IDLE) {
-          http.header(404, "Invalid State, Card Present or Busy");
+        // built aside, the dealer may still be reading its deal
+        Deal deal;
+        if (http.param.count("gen")) {
+          // random deal matching a constraint, see DealConstraint, only one
+          // step of tries here, hard constraints belong in /boards?gen=
+          DealGenerator gen(http.param.count("seed") ? strtoull(http.param["seed"].c_str(), NULL, 10) : esp_random());
+          Bitboard bits;
+          if (!gen.constraint.parse(http.param["gen"].c_str()) || !gen.generate(atoi(http.param["index"].c_str()), bits, GEN_STEP_TRIES) || !bits.to(deal)) {
+            http.header(200, "No Deal Generated");
+            http.close();
+            return;
+          }
+        } else if (http.param.count("id")) {
+          // deal by index, see DealId, or a uniformly random one
+          DealId id;
+          Bitboard bits;
+          if (http.param["id"] == "random") {
+            id.random();
+          } else if (!id.parse(http.param["id"].c_str())) {
+            http.header(200, "Invalid Deal Id");
+            http.close();
+            return;
+          }
+          id.decode(bits);
+          if (!bits.to(deal)) {
+            http.header(200, "Invalid Deal Id");
+            http.close();
+            return;
+          }
+        } else if (!deal.parse(http.param["deal"].c_str())) {
+          http.header(200, "Cards not Parsed Correctly");
           http.close();
           return;
         }
+        deal.debug();
 
         // load first card
         if (!ejector.load()) {
@@ -190,70 +299,328 @@ class Dealer : public IdleComponent {
         http.close();
 
         // start dealing
+        dealer.deal = deal;
         dealer.reset(DEALER_DEALING);
+        dealer.queued = false;
+        dealer.predictive = http.param["predict"] == "1";
 
         // start turning to the correct position for the first card
-        dealer.deal_position = dealer.owner_position(ejector.loaded_card);
-        angle.turnTo(dealer.deal_position);
+        dealer.position(ejector.current_card);
       });
     }
 
     void reset(DealerState state = DEALER_IDLE)
     {
       if (state != DEALER_IDLE) {
+        drop_checkpoint();
         for (int i = 0 ; i < DECKLEN ; i++) {
           card_count[i] = 0;
           card_hist[i] = CARD_NULL;
+          rotate_expected[i] = -1;
+          rotate_actual[i] = -1;
         }
+        rotate_card = CARD_NULL;
         deal_count = 0;
         deal_position = -1;
+        start_tm = millis();
+        start_transactions = bus.transactions();
+        metrics.start();
+        outcome = NULL;
       }
       this->state = state;
       this->last_tm = millis();
     }
 
+    int seat_position(int player)
+    {
+      return player * 20;
+    }
+
     int owner_position(int card)
     {
-      return deal.owner[card] * 20;
+      return seat_position(deal.owner[card]);
     }
 
-    bool card_ready(int card)
+    // start turning towards the owner of a card, true when in position
+    bool position(int card)
     {
-      // do something for this card
-      dprintf("dealer: card %d, %s", card, full_name(card));
+      if (state != DEALER_DEALING || card < 0 || card >= DECKLEN || !angle.active) {
+        return true;
+      }
+      float pos = owner_position(card);
+      if (pos != deal_position) {
+        deal_position = pos;
+        angle.turnTo(pos);
+      }
+      // deal_count is DECKLEN after the last card, there may still be one loaded
+      bool measure = deal_count < DECKLEN;
+      if (measure && rotate_card != card && rotate_actual[deal_count] < 0) {
+        rotate_card = card;
+        rotate_tm = millis();
+        rotate_us = micros();
+        rotate_distance = fabs(adiff(pos, angle.value()));
+      }
+      if (!angle.near(pos)) {
+        return false;
+      }
+      ejector.cycle.mark(MARK_ROTATED, millis());
+      if (measure && rotate_card == card) {
+        // measure the rotation left after the card was identified
+        int actual = millis() - rotate_tm;
+        rotate_expected[deal_count] = int(rotate_distance / rotate_rate);
+        rotate_actual[deal_count] = actual;
+        if (rotate_distance > 5 && actual > 0) {
+          rotate_rate = 0.8f * rotate_rate + 0.2f * rotate_distance / actual;
+        }
+        tracer.add(SPAN_ROTATE, card == ejector.loaded_card ? ejector.loaded_trace : ejector.current_trace, rotate_us, micros());
+        rotate_card = CARD_NULL;
+      }
       return true;
     }
 
+    // After an eager eject the next card is loaded while it is still being identified,
+    // meanwhile move to the seat that minimizes the expected correction, given the
+    // owners of the cards not dealt yet (the ejected card is already counted).
+    void preposition()
+    {
+      int remaining[NPLAYERS] = {0, 0, 0, 0};
+      for (int c = 0 ; c < DECKLEN ; c++) {
+        if (card_count[c] == 0) {
+          remaining[deal.owner[c]] += 1;
+        }
+      }
+      float best = -1;
+      float best_cost = 0;
+      for (int p = 0 ; p < NPLAYERS ; p++) {
+        float cost = 0;
+        for (int q = 0 ; q < NPLAYERS ; q++) {
+          cost += remaining[q] * fabs(adiff(seat_position(q), seat_position(p)));
+        }
+        if (best < 0 || cost < best_cost) {
+          best = seat_position(p);
+          best_cost = cost;
+        }
+      }
+      if (best >= 0 && best != deal_position) {
+        deal_position = best;
+        angle.turnTo(best);
+      }
+    }
+
+    bool card_ready(int card)
+    {
+      return position(card);
+    }
+
+    // the card that will be ejected next, once the previous card has left
+    int next_card()
+    {
+      switch (ejector.state) {
+        case EJECT_CAPTURING:
+        case EJECT_LOADING:
+        case EJECT_RETRACTING:
+        case EJECT_FINISH:
+          return ejector.loaded_card < DECKLEN ? ejector.loaded_card : ejector.current_card;
+        default:
+          return CARD_NULL;
+      }
+    }
+
     void collate()
     {
         if (state == DEALER_LEARNING && deal_count > 0) {
           dprintf("dealer: collating %d cards", deal_count);
-          bus.request(CAMERA_ADDR, (const unsigned char []){CMD_COLLATE}, 1, NULL, 0);
+          bus.request(BUS_ROLE_CAMERA, (const unsigned char []){CMD_COLLATE}, 1, NULL, 0);
         }
     }
 
+    // start the next board from the queue, if the hopper has been reloaded
+    void start_board()
+    {
+      if (card.state || checkpoint.state != DEALER_IDLE) {
+        return;
+      }
+      Deal d;
+      if (!boards.get(boards.next, d)) {
+        boards.stop();
+        return;
+      }
+      if (!ejector.load()) {
+        return;
+      }
+      deal = d;
+      reset(DEALER_DEALING);
+      queued = true;
+      predictive = false;
+      boards.dealing();
+    }
+
     void deal_done()
     {
+        if (queued && deal_count == 0) {
+          // the hopper was empty, try again later
+          queued = false;
+          outcome = "hopper empty";
+          boards.waiting();
+          reset(DEALER_IDLE);
+          return;
+        }
         deal_summary();
         dprintf("dealer: done after %d cards", deal_count);
+        outcome = "done";
         collate();
+        drop_checkpoint();
+        if (deal_count == DECKLEN) {
+          archive.add(deal, queued ? boards.next : -1);
+        }
+        if (queued) {
+          queued = false;
+          boards.done(deal_count, millis() - start_tm);
+        }
         reset(DEALER_IDLE);
   }
 
     void deal_failed(const char *reason)
     {
+        // a card that failed to leave was not dealt
+        EjectState s = ejector.state == EJECT_FAILED ? ejector.failed_state : ejector.state;
+        if (deal_count > 0 && (s == EJECT_IDENTIFYING || s == EJECT_EJECTING)) {
+          deal_count -= 1;
+          if (card_hist[deal_count] >= 0 && card_hist[deal_count] < DECKLEN) {
+            card_count[card_hist[deal_count]] -= 1;
+          }
+          card_hist[deal_count] = CARD_NULL;
+        }
         deal_summary();
         dprintf("dealer: failed after %d cards, %s", deal_count, reason);
+        outcome = reason;
         collate();
+        save_checkpoint(true);
+        if (queued) {
+          boards.failed();
+        }
         reset(DEALER_IDLE);
     }
 
+    //
+    // Checkpoints, kept in RAM for every card, and in flash every few cards
+    // and when a deal fails, so that it can be resumed after clearing a jam.
+    //
+    void save_checkpoint(bool flash)
+    {
+      DealCheckpoint &c = checkpoint;
+      c.state = state;
+      c.deal_count = deal_count;
+      c.predictive = predictive;
+      c.board = queued ? boards.next : -1;
+      c.deal = deal;
+      memset(c.card_count, 0, sizeof(c.card_count));
+      memset(c.card_hist, CARD_NULL, sizeof(c.card_hist));
+      // only cards that have left the machine
+      for (int i = 0 ; i < deal_count ; i++) {
+        c.card_hist[i] = card_hist[i];
+        if (card_hist[i] >= 0 && card_hist[i] < DECKLEN) {
+          c.card_count[card_hist[i]] += 1;
+        }
+      }
+      if (!flash && deal_count < checkpoint_count + CHECKPOINT_CARDS) {
+        return;
+      }
+      File file = LittleFS.open(CHECKPOINT_FILE, FILE_WRITE);
+      if (!file) {
+        dprintf("error: failed to open for write: %s", CHECKPOINT_FILE);
+        return;
+      }
+      file.write((const uint8_t *)&c, sizeof(c));
+      file.close();
+      checkpoint_count = deal_count;
+    }
+
+    void load_checkpoint()
+    {
+      File file = LittleFS.open(CHECKPOINT_FILE, FILE_READ);
+      if (!file) {
+        return;
+      }
+      DealCheckpoint c;
+      bool ok = file.read((uint8_t *)&c, sizeof(c)) == sizeof(c) && c.version == CHECKPOINT_VERSION;
+      file.close();
+      if (ok && c.state != DEALER_IDLE) {
+        checkpoint = c;
+        dprintf("dealer: found checkpoint after %d cards, use /resume to continue", c.deal_count);
+      }
+    }
+
+    void drop_checkpoint()
+    {
+      checkpoint.state = DEALER_IDLE;
+      checkpoint_count = 0;
+      if (LittleFS.exists(CHECKPOINT_FILE)) {
+        LittleFS.remove(CHECKPOINT_FILE);
+      }
+    }
+
+    // continue from the last checkpoint, with the remaining cards in the hopper
+    bool resume()
+    {
+      DealCheckpoint c = checkpoint;
+      if (c.state == DEALER_IDLE || c.deal_count >= DECKLEN) {
+        dprintf("dealer: nothing to resume");
+        return false;
+      }
+      bool learn = c.state == DEALER_LEARNING;
+      unsigned char req[] = {CMD_RESTORE, (unsigned char)learn, (unsigned char)c.deal_count, 
+        c.deal_count > 0 ? c.card_hist[c.deal_count-1] : (unsigned char)CARD_NULL};
+      if (!bus.request(BUS_ROLE_CAMERA, req, sizeof(req))) {
+        dprintf("dealer: failed to restore camera");
+        return false;
+      }
+      if (!ejector.load(learn, false)) {
+        return false;
+      }
+      reset((DealerState)c.state);
+      deal = c.deal;
+      deal_count = c.deal_count;
+      predictive = c.predictive;
+      queued = c.board >= 0 && c.board == boards.next;
+      if (queued) {
+        boards.dealing();
+      }
+      for (int i = 0 ; i < DECKLEN ; i++) {
+        card_count[i] = c.card_count[i];
+        card_hist[i] = c.card_hist[i];
+      }
+      save_checkpoint(true);
+      dprintf("dealer: resuming at card %d", deal_count);
+      return true;
+    }
+
     void deal_summary()
     {
-      dprintf("dealer: dealt %d cards", deal_count);
+      unsigned long ms = millis() - start_tm;
+      unsigned long transactions = bus.transactions() - start_transactions;
+      dprintf("dealer: dealt %d cards in %lums, %.1f cards/min, %.1f bus transactions/card", deal_count, ms, 
+        ms == 0 ? 0.0f : deal_count * 60000.0f / ms, deal_count == 0 ? 0.0f : float(transactions) / deal_count);
+      metrics.done(deal_count, ms);
+      metrics.summary();
       for (int i = 0 ; i < deal_count ; i++) {
         dprintf("dealer: card %d, %s%s", i, full_name(card_hist[i]), card_count[card_hist[i]] > 1 ? " (DUPLICATE)" : "");
       }
+      int rotate_count = 0;
+      long expected_total = 0;
+      long actual_total = 0;
+      for (int i = 0 ; i < deal_count ; i++) {
+        if (rotate_actual[i] >= 0) {
+          dprintf("dealer: card %d, rotation expected %dms, actual %dms", i, rotate_expected[i], rotate_actual[i]);
+          rotate_count++;
+          expected_total += rotate_expected[i];
+          actual_total += rotate_actual[i];
+        }
+      }
+      if (rotate_count > 0) {
+        dprintf("dealer: %d rotations%s, expected %ldms, actual %ldms, rate=%.3f deg/ms", rotate_count, predictive ? " (predictive)" : "",
+          expected_total, actual_total, rotate_rate);
+      }
       int order_count = 0;
       for (int i = 0 ; i < DECKLEN-1 ; i++) {
         if (card_hist[i]+1 == card_hist[i+1]) {
@@ -282,7 +649,41 @@ class Dealer : public IdleComponent {
       }
     }
 
+    // woken by events, the poll interval is a safety net
     virtual void idle(unsigned long now) 
+    {
+      if (state == DEALER_IDLE && boards.ready(now)) {
+        start_board();
+      }
+      if (state != DEALER_IDLE && now > last_tm + DEALER_TIMEOUT) {
+        events.post(EV_TIMEOUT);
+      }
+      for (Event e ; events.pop(e) ;) {
+        handle(e);
+      }
+      step();
+    }
+
+    void handle(const Event &e)
+    {
+      switch (e.type) {
+        case EV_TIMEOUT:
+          if (state != DEALER_IDLE) {
+            dprintf("STATE=%d, %d/%d", ejector.state, ejector.current_card, ejector.loaded_card);
+            deal_failed("timeout");
+          }
+          break;
+        case EV_CARD_LEFT:
+          if (state != DEALER_IDLE) {
+            last_tm = millis();
+          }
+          break;
+        default:
+          break;
+      }
+    }
+
+    void step()
     {
       switch (state) {
         case DEALER_IDLE:
@@ -290,11 +691,6 @@ class Dealer : public IdleComponent {
         case DEALER_DEALING:
         case DEALER_LEARNING:
         case DEALER_VERIFYING:
-          if (now > last_tm + 10000) {
-            dprintf("STATE=%d, %d/%d", ejector.state, ejector.current_card, ejector.loaded_card);
-            deal_failed("timeout");
-            return;
-          }
           switch (ejector.state) {
             case EJECT_OK:
             case EJECT_IDLE:
@@ -318,6 +714,7 @@ class Dealer : public IdleComponent {
                       return;
                     }
                     if (card_hist[deal_count] == CARD_NULL) {
+                      dprintf("dealer: card %d, %s", ejector.loaded_card, full_name(ejector.loaded_card));
                       if (card_count[ejector.loaded_card] > 0) {
                         dprintf("dealer: duplicate card %d, %s", ejector.loaded_card, full_name(ejector.loaded_card));
                       }
@@ -326,19 +723,29 @@ class Dealer : public IdleComponent {
                       last_tm = millis();
                     }
                     if (card_ready(ejector.loaded_card)) {
-                      if (!ejector.eject()) {
+                      if (!ejector.eject(predictive && state == DEALER_DEALING)) {
                         deal_failed("eject failed");
                         return;
                       }
                       deal_count += 1;
                       last_tm = millis();
+                      save_checkpoint(false);
                     }
                   }
               }
               break;
             case EJECT_FAILED:
-              deal_failed("eject failed");
+              deal_failed(ejector.failed_state == EJECT_CAPTURING || ejector.failed_state == EJECT_IDENTIFYING || ejector.current_card == CARD_FAIL ? "identify failed" : "eject failed");
               return;
+            default:
+              // overlap the rotation with loading, retracting and finishing,
+              // the ejected card must have left before turning
+              if (next_card() < DECKLEN) {
+                position(next_card());
+              } else if (predictive && state == DEALER_DEALING && ejector.state == EJECT_LOADING) {
+                preposition();
+              }
+              break;
           }
           
       }
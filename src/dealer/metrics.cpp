@@ -0,0 +1,144 @@
+// (c)2024, Arthur van Hoff, Artfahrt Inc.
+#include "metrics.h"
+#include "webserver.h"
+
+// the phase that ends at a mark
+const char *card_phase_name(int m)
+{
+    switch (m) {
+      case MARK_LOAD: return "start";
+      case MARK_DETECTED: return "load";
+      case MARK_CAPTURE: return "settle";
+      case MARK_IDENTIFIED: return "identify";
+      case MARK_ROTATED: return "rotate";
+      case MARK_EJECTED: return "eject";
+      default: return "unknown";
+    }
+}
+
+// time since the mark before it, the marks overlap so this goes by time
+unsigned long CardCycle::phase(int m) const
+{
+    if (tm[m] == 0) {
+        return 0;
+    }
+    unsigned long prev = 0;
+    bool found = false;
+    for (int i = 0 ; i < CARD_MARKS ; i++) {
+        if (i == m || tm[i] == 0) {
+            continue;
+        }
+        long d = tm[m] - tm[i];
+        if ((d > 0 || (d == 0 && i < m)) && (!found || long(tm[i] - prev) > 0)) {
+            prev = tm[i];
+            found = true;
+        }
+    }
+    return found ? tm[m] - prev : 0;
+}
+
+unsigned long CardCycle::total() const
+{
+    unsigned long first = 0, last = 0;
+    bool found = false;
+    for (int i = 0 ; i < CARD_MARKS ; i++) {
+        if (tm[i] == 0) {
+            continue;
+        }
+        if (!found || long(tm[i] - first) < 0) {
+            first = tm[i];
+        }
+        if (!found || long(tm[i] - last) > 0) {
+            last = tm[i];
+        }
+        found = true;
+    }
+    return last - first;
+}
+
+void CardMetrics::start()
+{
+    count = 0;
+}
+
+// a card was ejected
+void CardMetrics::add(const CardCycle &c)
+{
+    if (count < DECKLEN) {
+        cycles[count++] = c;
+    }
+    for (int m = 0 ; m < CARD_MARKS ; m++) {
+        if (c.tm[m] != 0) {
+            phases[m].add(c.phase(m));
+        }
+    }
+    cycle.add(c.total());
+    cards++;
+}
+
+void CardMetrics::done(int ncards, unsigned long ms)
+{
+    deals++;
+    deal_ms += ms;
+    rate = ms == 0 ? 0 : ncards * 60000.0f / ms;
+}
+
+// percentiles of the phases in this deal
+void CardMetrics::summary()
+{
+    if (count == 0) {
+        return;
+    }
+    unsigned long v[DECKLEN];
+    for (int m = 0 ; m <= CARD_MARKS ; m++) {
+        unsigned long total = 0;
+        for (int i = 0 ; i < count ; i++) {
+            v[i] = m == CARD_MARKS ? cycles[i].total() : cycles[i].phase(m);
+            total += v[i];
+        }
+        std::sort(v, v + count);
+        dprintf("dealer: %-8s avg=%lums p50=%lums p90=%lums max=%lums", m == CARD_MARKS ? "cycle" : card_phase_name(m),
+          total / count, v[(count - 1) * 50 / 100], v[(count - 1) * 90 / 100], v[count - 1]);
+    }
+}
+
+// cumulative buckets in seconds, the histograms are in ms
+static void print_histogram(HTTP &http, const char *name, const char *label, Histogram &h)
+{
+    const char *sep = label[0] ? "," : "";
+    unsigned long sum = 0;
+    for (int b = 0 ; b < HISTOGRAM_BUCKETS - 1 ; b++) {
+        sum += h.buckets[b];
+        http.printf("%s_bucket{%s%sle=\"%.3f\"} %lu\n", name, label, sep, Histogram::bucket_max(b) / 1000.0f, sum);
+    }
+    http.printf("%s_bucket{%s%sle=\"+Inf\"} %lu\n", name, label, sep, h.count);
+    http.printf("%s_sum{%s} %.3f\n", name, label, h.total / 1000.0);
+    http.printf("%s_count{%s} %lu\n", name, label, h.count);
+}
+
+void CardMetrics::init()
+{
+    WebServer::add("/metrics", [](HTTP &http) {
+      CardMetrics &c = ::metrics;
+      http.header(200, "Metrics");
+      http.printf("Content-Type: text/plain; version=0.0.4\n");
+      http.body();
+      http.printf("# HELP dealer_cards_total Cards ejected.\n# TYPE dealer_cards_total counter\n");
+      http.printf("dealer_cards_total %lu\n", c.cards);
+      http.printf("# HELP dealer_deals_total Deals finished or failed.\n# TYPE dealer_deals_total counter\n");
+      http.printf("dealer_deals_total %lu\n", c.deals);
+      http.printf("# HELP dealer_dealing_seconds_total Time spent dealing.\n# TYPE dealer_dealing_seconds_total counter\n");
+      http.printf("dealer_dealing_seconds_total %.3f\n", c.deal_ms / 1000.0);
+      http.printf("# HELP dealer_cards_per_minute Cards per minute in the last deal.\n# TYPE dealer_cards_per_minute gauge\n");
+      http.printf("dealer_cards_per_minute %.1f\n", c.rate);
+      http.printf("# HELP dealer_card_cycle_seconds Time per card, from loading until ejected.\n# TYPE dealer_card_cycle_seconds histogram\n");
+      print_histogram(http, "dealer_card_cycle_seconds", "", c.cycle);
+      http.printf("# HELP dealer_card_phase_seconds Time per card in each phase of the cycle.\n# TYPE dealer_card_phase_seconds histogram\n");
+      for (int m = 0 ; m < CARD_MARKS ; m++) {
+        char label[32];
+        snprintf(label, sizeof(label), "phase=\"%s\"", card_phase_name(m));
+        print_histogram(http, "dealer_card_phase_seconds", label, c.phases[m]);
+      }
+      http.close();
+    });
+}
@@ -0,0 +1,58 @@
+// (c)2024, Arthur van Hoff, Artfahrt Inc.
+#pragma once
+#include "util.h"
+#include "deal.h"
+
+//
+// Marks in the cycle of a card, from the start of loading it until it
+// is ejected. The next card is captured and identified while this one
+// waits in the ejector, so the cycle time is the time per card.
+//
+enum CardMark {
+    MARK_LOAD,                      // loading started
+    MARK_DETECTED,                  // card reached the sensor
+    MARK_CAPTURE,                   // capture of the next card sent
+    MARK_IDENTIFIED,                // next card identified
+    MARK_ROTATED,                   // rotated to the owner of this card
+    MARK_EJECTED,                   // card left the sensor
+    CARD_MARKS,
+};
+
+struct CardCycle {
+    unsigned long tm[CARD_MARKS];   // millis, 0 if not reached
+
+    void clear() { memset(tm, 0, sizeof(tm)); }
+    void mark(int m, unsigned long t) { if (tm[m] == 0) tm[m] = t; }
+    unsigned long phase(int m) const;
+    unsigned long total() const;
+};
+
+extern const char *card_phase_name(int m);
+
+//
+// Card cycle metrics, the phases of the cards in the current deal for
+// the deal summary, and histograms (in ms) and totals since boot for
+// /metrics, in the Prometheus text format.
+//
+class CardMetrics : public InitComponent {
+  public:
+    CardCycle cycles[DECKLEN];      // this deal
+    int count = 0;
+    Histogram phases[CARD_MARKS];
+    Histogram cycle;
+    unsigned long cards = 0;
+    unsigned long deals = 0;
+    unsigned long long deal_ms = 0;
+    float rate = 0;                 // cards/min of the last deal
+
+  public:
+    CardMetrics() : InitComponent("Metrics") {}
+    virtual void init();
+
+    void start();
+    void add(const CardCycle &c);
+    void done(int ncards, unsigned long ms);
+    void summary();
+};
+
+extern CardMetrics metrics;
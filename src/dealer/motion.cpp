@@ -0,0 +1,146 @@
+// (c)2024, Arthur van Hoff, Artfahrt Inc.
+
+#include "motion.h"
+
+//
+// MotionProfile
+//
+
+// time needed to reach velocity v from rest
+float MotionProfile::ramp_time(float v, float amax, float jmax)
+{
+    if (shape == MOTION_TRAPEZOID) {
+        return v / amax;
+    }
+    // sine ramp: peak acceleration is pi*v/(2T), peak jerk is pi^2*v/(2T^2)
+    return max(float(M_PI) * v / (2 * amax), float(M_PI) * sqrtf(v / (2 * jmax)));
+}
+
+void MotionProfile::plan(MotionShape shape, float distance, float vmax, float amax, float jmax)
+{
+    this->shape = shape;
+    this->distance = distance;
+    float d = fabs(distance);
+
+    // each ramp covers v*T/2, reduce the peak velocity for short moves
+    float v = vmax;
+    if (v * ramp_time(v, amax, jmax) > d) {
+        if (shape == MOTION_TRAPEZOID) {
+            v = sqrtf(d * amax);
+        } else {
+            float va = sqrtf(2 * amax * d / float(M_PI));
+            float vj = powf(d * sqrtf(2 * jmax) / float(M_PI), 2.0f / 3.0f);
+            v = min(va, vj);
+        }
+    }
+    peak = v;
+    ramp = v > 0 ? ramp_time(v, amax, jmax) : 0;
+    cruise = v > 0 ? max(0.0f, (d - v * ramp) / v) : 0;
+    duration = 2 * ramp + cruise;
+}
+
+// unsigned distance covered t seconds into the ramp up
+float MotionProfile::ramp_position(float t)
+{
+    if (ramp <= 0) {
+        return 0;
+    }
+    float u = t / ramp;
+    if (shape == MOTION_TRAPEZOID) {
+        return peak * ramp * u * u / 2;
+    }
+    return peak * ramp / 2 * (u - sinf(float(M_PI) * u) / float(M_PI));
+}
+
+float MotionProfile::position(float t)
+{
+    float p;
+    if (t <= 0) {
+        p = 0;
+    } else if (t >= duration) {
+        p = fabs(distance);
+    } else if (t < ramp) {
+        p = ramp_position(t);
+    } else if (t < ramp + cruise) {
+        p = peak * ramp / 2 + peak * (t - ramp);
+    } else {
+        p = fabs(distance) - ramp_position(duration - t);
+    }
+    return distance < 0 ? -p : p;
+}
+
+float MotionProfile::velocity(float t)
+{
+    float v;
+    if (t <= 0 || t >= duration) {
+        v = 0;
+    } else if (t >= ramp && t < ramp + cruise) {
+        v = peak;
+    } else {
+        float u = (t < ramp ? t : duration - t) / ramp;
+        v = shape == MOTION_TRAPEZOID ? peak * u : peak * (1 - cosf(float(M_PI) * u)) / 2;
+    }
+    return distance < 0 ? -v : v;
+}
+
+float MotionProfile::acceleration(float t)
+{
+    float a;
+    if (t <= 0 || t >= duration || (t >= ramp && t < ramp + cruise)) {
+        a = 0;
+    } else {
+        float u = (t < ramp ? t : duration - t) / ramp;
+        a = shape == MOTION_TRAPEZOID ? peak / ramp : peak * float(M_PI) * sinf(float(M_PI) * u) / (2 * ramp);
+        a = t < ramp ? a : -a;
+    }
+    return distance < 0 ? -a : a;
+}
+
+//
+// PID
+//
+
+void PID::reset()
+{
+    integral = 0;
+    last_error = 0;
+    first = true;
+}
+
+float PID::update(float error, float dt)
+{
+    float derivative = first || dt <= 0 ? 0 : (error - last_error) / dt;
+    integral = max(-limit, min(integral + ki * error * dt, limit));
+    last_error = error;
+    first = false;
+    return kp * error + integral + kd * derivative;
+}
+
+//
+// MotionController
+//
+
+void MotionController::start(float distance)
+{
+    profile.plan(shape, distance, vmax, amax, jmax);
+    pid.reset();
+    elapsed = 0;
+}
+
+// traveled is the signed distance moved since start
+float MotionController::update(float traveled, float dt)
+{
+    elapsed += dt;
+    float error = profile.position(elapsed) - traveled;
+    float out = kff * profile.velocity(elapsed) + kacc * profile.acceleration(elapsed) + pid.update(error, dt);
+    if (fabs(out) < 0.5f) {
+        return 0;
+    }
+    out += out > 0 ? kstatic : -kstatic;
+    return max(-max_output, min(out, max_output));
+}
+
+bool MotionController::done(float traveled)
+{
+    return elapsed >= profile.duration && fabs(profile.distance - traveled) < tolerance;
+}
@@ -0,0 +1,74 @@
+// (c)2024, Arthur van Hoff, Artfahrt Inc.
+
+#pragma once
+#include "util.h"
+
+enum MotionShape {
+    MOTION_TRAPEZOID,       // acceleration limited
+    MOTION_SCURVE,          // acceleration and jerk limited, sine shaped ramps
+};
+
+//
+// A symmetric move over distance (may be negative), starting and ending 
+// at rest: ramp up, cruise, ramp down. Units are degrees and seconds.
+//
+class MotionProfile {
+  public:
+    MotionShape shape = MOTION_TRAPEZOID;
+    float distance = 0;
+    float peak = 0;         // peak velocity
+    float ramp = 0;         // duration of each ramp
+    float cruise = 0;       // duration at peak velocity
+    float duration = 0;
+
+  public:
+    void plan(MotionShape shape, float distance, float vmax, float amax, float jmax);
+    float position(float t);
+    float velocity(float t);
+    float acceleration(float t);
+
+  private:
+    float ramp_time(float v, float amax, float jmax);
+    float ramp_position(float t);
+};
+
+class PID {
+  public:
+    float kp;
+    float ki;
+    float kd;
+    float limit;            // bound on the integral term
+    float integral = 0;
+    float last_error = 0;
+    bool first = true;
+
+  public:
+    PID(float kp, float ki, float kd, float limit) : kp(kp), ki(ki), kd(kd), limit(limit) {}
+    void reset();
+    float update(float error, float dt);
+};
+
+//
+// Tracks a motion profile with PID plus velocity feedforward.
+// The output is in motor speed units.
+//
+class MotionController {
+  public:
+    MotionShape shape = MOTION_TRAPEZOID;
+    float vmax = 180;       // deg/s
+    float amax = 1500;      // deg/s^2
+    float jmax = 6000;      // deg/s^3, S-curve only
+    float kff = 0.55;       // speed per deg/s
+    float kacc = 0.02;      // speed per deg/s^2, compensates for motor lag
+    float kstatic = 25;     // speed needed to overcome static friction
+    float max_output = 200;
+    float tolerance = 1;    // deg
+    PID pid = PID(8.0, 4.0, 0.3, 20);
+    MotionProfile profile;
+    float elapsed = 0;
+
+  public:
+    void start(float distance);
+    float update(float traveled, float dt);
+    bool done(float traveled);
+};
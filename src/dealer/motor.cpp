@@ -13,56 +13,101 @@
 // Motor
 //
 
+void Motor::post(const MotorCommand &cmd)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    command = cmd;
+    posted = true;
+    last_speed_ms = millis();
+}
+
 void Motor::stop() 
 {
-    pwm1.write(0);
-    pwm2.write(0);
-    goal_speed = 0;
-    current_speed = 0;
+    post({0, 0, true, false, false});
 }
 
 void Motor::brake()
 {
-    pwm1.write(1);
-    pwm2.write(1);
-    goal_speed = 0;
-    current_speed = 0;
+    post({0, 0, true, false, true});
 }
+
 void Motor::reverse()
 {
-    int v2 = pwm2.value;
-    pwm2.write(pwm1.value);
-    pwm1.write(v2);
-    goal_speed = -goal_speed;
-    current_speed = -current_speed;
+    std::lock_guard<std::mutex> guard(lock);
+    if (!posted) {
+        command = {goal_speed, 0, false, false, false};
+    }
+    command.goal_speed = -command.goal_speed;
+    command.current_speed = -command.current_speed;
+    command.flip = !command.set_current && !command.flip;
+    command.brake = false;
+    posted = true;
 }
 
 void Motor::set_speed(float speed) 
 {
     float m = max_speed();
-    goal_speed = max(-m, min(speed, m));
+    std::lock_guard<std::mutex> guard(lock);
+    if (!posted) {
+        command = {0, 0, false, false, false};
+    }
+    command.goal_speed = max(-m, min(speed, m));
+    command.brake = false;
+    posted = true;
     last_speed_ms = millis();
     //dprintf("motor %s: set_speed %f, current=%f", name, goal_speed, current_speed);
 }
+
+// set the speed without ramping, for callers that shape the motion themselves
+void Motor::drive(float speed)
+{
+    float m = max_speed();
+    speed = max(-m, min(speed, m));
+    post({speed, speed, true, false, false});
+}
  
-void Motor::idle(unsigned long now) 
+void Motor::control(unsigned long now_us, float dt) 
 {
+    {
+        // a command being posted is picked up on the next tick
+        std::unique_lock<std::mutex> guard(lock, std::try_to_lock);
+        if (guard.owns_lock() && posted) {
+            goal_speed = command.goal_speed;
+            if (command.set_current) {
+                current_speed = command.current_speed;
+            } else if (command.flip) {
+                current_speed = -current_speed;
+            }
+            braking = command.brake;
+            posted = false;
+            apply();
+        }
+    }
     if (current_speed != goal_speed) {
-        unsigned long ms = now - last_idle_tm;
-        float max_delta = max_accel_per_sec * ms / 1000.0f;
+        float max_delta = max_accel_per_sec * dt;
         if (current_speed < goal_speed) {
             current_speed = min(goal_speed, current_speed + max_delta);
         } else {
             current_speed = max(goal_speed, current_speed - max_delta);
         }
-        //dprintf("motor %s: update, current=%f goal=%f max/sec=%f, delta=%f, ms=%lu", name, current_speed, goal_speed, max_accel_per_sec, max_delta, ms);
-        int value = int(abs(current_speed) * PWM_MAX / max_value);
-        if (current_speed > 0) {
-            pwm1.write(value);
-            pwm2.write(0);
-        } else {
-            pwm2.write(value);
-            pwm1.write(0);
-        }
+        //dprintf("motor %s: update, current=%f goal=%f max/sec=%f, delta=%f, dt=%f", name, current_speed, goal_speed, max_accel_per_sec, max_delta, dt);
+        apply();
     } 
 }
+
+void Motor::apply()
+{
+    if (braking) {
+        pwm1.write(1);
+        pwm2.write(1);
+        return;
+    }
+    int value = int(abs(current_speed) * PWM_MAX / max_value);
+    if (current_speed > 0) {
+        pwm1.write(value);
+        pwm2.write(0);
+    } else {
+        pwm2.write(value);
+        pwm1.write(0);
+    }
+}
@@ -1,6 +1,7 @@
 // (c)2024, Arthur van Hoff, Artfahrt Inc.
 #pragma once
 #include "util.h"
+#include "control.h"
 
 #define PWM_FREQ    500
 #define PWM_BITS    10
@@ -43,7 +44,23 @@ class PWM : public InitComponent {
     }
 };
 
-class Motor : IdleComponent {
+//
+// A command posted to the control task, the last one wins but a stop
+// or drive in between still resets the ramp.
+//
+struct MotorCommand {
+    float goal_speed;
+    float current_speed;            // when set_current
+    bool set_current;
+    bool flip;                      // reverse the current speed
+    bool brake;
+};
+
+//
+// The speed is set from any task, the ramp and all PWM writes are done
+// by the control task, so pin modes and LEDC channels have one writer.
+//
+class Motor : public ControlComponent {
   public:
     PWM pwm1;
     PWM pwm2;
@@ -51,11 +68,15 @@ class Motor : IdleComponent {
     float max_accel_per_sec;
     float goal_speed = 0;
     float current_speed = 0;
+    bool braking = false;
     unsigned long last_speed_ms = 0; 
+    MotorCommand command = {0, 0, false, false, false};
+    bool posted = false;
+    std::mutex lock;                // command
     
   public:
     Motor(const char *name, int pin1, int pin2, float max_value=100, float max_accel_per_sec=100000) 
-      : IdleComponent(name), pwm1(pin1), pwm2(pin2), max_value(max_value), max_accel_per_sec(max_accel_per_sec)
+      : ControlComponent(name), pwm1(pin1), pwm2(pin2), max_value(max_value), max_accel_per_sec(max_accel_per_sec)
     {
     }
 
@@ -78,7 +99,11 @@ class Motor : IdleComponent {
     void brake();
     void reverse();
     virtual void set_speed(float speed);
-    virtual void idle(unsigned long now);
+    void drive(float speed);
+    virtual void control(unsigned long now_us, float dt);
+  private:
+    void post(const MotorCommand &cmd);
+    void apply();
 };
 
 extern Motor motor1;
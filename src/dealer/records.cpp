@@ -0,0 +1,164 @@
+// (c)2024, Arthur van Hoff, Artfahrt Inc.
+#include "records.h"
+#include "webserver.h"
+
+const char *record_state_name(int state)
+{
+    switch (state) {
+      case RECORD_NONE: return "none";
+      case RECORD_PENDING: return "pending";
+      case RECORD_SOLVING: return "solving";
+      case RECORD_DONE: return "done";
+      case RECORD_FAILED: return "failed";
+      default: return "unknown";
+    }
+}
+
+#ifdef ARDUINO
+static TaskHandle_t records_task = NULL;
+
+static void records_task_main(void *arg)
+{
+    HandRecords *r = (HandRecords *)arg;
+    for (;;) {
+      ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+      r->run();
+    }
+}
+#endif
+
+// queue a board for solving
+bool HandRecords::solve(int board, const Deal &deal)
+{
+    if (board < 0 || board >= BOARDS_MAX) {
+        return false;
+    }
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        Record &r = records[board];
+        if (r.state == RECORD_SOLVING && solver != NULL) {
+            solver->abort = true;
+        }
+        r.bits.from(deal);
+        r.table.clear();
+        r.state = RECORD_PENDING;
+    }
+#ifdef ARDUINO
+    xTaskNotifyGive(records_task);
+#else
+    run();
+#endif
+    return true;
+}
+
+void HandRecords::cancel()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    for (int i = 0 ; i < BOARDS_MAX ; i++) {
+        if (records[i].state == RECORD_PENDING || records[i].state == RECORD_SOLVING) {
+            records[i].state = RECORD_NONE;
+        }
+    }
+    if (solver != NULL) {
+        solver->abort = true;
+    }
+}
+
+// the next pending board, marked as solving
+int HandRecords::next(Bitboard &bits)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    for (int i = 0 ; i < BOARDS_MAX ; i++) {
+        if (records[i].state == RECORD_PENDING) {
+            records[i].state = RECORD_SOLVING;
+            bits = records[i].bits;
+            if (solver != NULL) {
+                solver->abort = false;
+            }
+            return i;
+        }
+    }
+    return -1;
+}
+
+// solve the pending boards, in the records task
+void HandRecords::run()
+{
+    if (solver == NULL) {
+        solver = new DDSolver();
+    }
+    Bitboard bits;
+    for (int i ; (i = next(bits)) >= 0 ;) {
+        DDTable table;
+        unsigned long tm = millis();
+        solver->nodes = 0;
+        bool ok = solver->solve(bits, table);
+
+        std::lock_guard<std::mutex> guard(lock);
+        Record &r = records[i];
+        if (r.state != RECORD_SOLVING) {
+            // cancelled or queued again
+            continue;
+        }
+        r.table = table;
+        r.ms = millis() - tm;
+        r.nodes = solver->nodes;
+        r.state = ok ? RECORD_DONE : RECORD_FAILED;
+        dprintf("records: board %d solved in %lums, %lu nodes", i + 1, (unsigned long)r.ms, r.nodes);
+    }
+}
+
+void HandRecords::init()
+{
+#ifdef ARDUINO
+    xTaskCreatePinnedToCore(records_task_main, name, RECORDS_STACK, this, RECORDS_PRIORITY, &records_task, 1 - ARDUINO_RUNNING_CORE);
+#endif
+    WebServer::add("/records", [](HTTP &http) {
+      if (http.param.count("board")) {
+        // solve a board from the queue again
+        int board = atoi(http.param["board"].c_str()) - 1;
+        Deal deal;
+        if (!::boards.get(board, deal) || !::records.solve(board, deal)) {
+          http.header(404, "Board Not Found");
+          http.close();
+          return;
+        }
+      } else if (http.param["cancel"] == "1") {
+        ::records.cancel();
+      }
+      http.header(200, "Hand Records");
+      http.printf("Content-Type: text/plain\n");
+      http.body();
+      for (int i = 0 ; i < BOARDS_MAX ; i++) {
+        Record r;
+        {
+          std::lock_guard<std::mutex> guard(::records.lock);
+          r = ::records.records[i];
+        }
+        if (r.state == RECORD_NONE) {
+          continue;
+        }
+        http.printf("board %d: %s", i + 1, record_state_name(r.state));
+        if (r.state != RECORD_DONE) {
+          http.printf("\n");
+          continue;
+        }
+        http.printf(", %.1fs, %lu nodes\n", r.ms / 1000.0f, r.nodes);
+        char buf[128];
+        r.table.print(buf, sizeof(buf));
+        http.printf("%s", buf);
+        // makeable contracts, highest level per declarer and strain
+        for (int p = 0 ; p < NPLAYERS ; p++) {
+          http.printf("%c:", player2ch(p));
+          for (int s = DD_STRAINS - 1 ; s >= 0 ; s--) {
+            int level = r.table.tricks[s][p] - 6;
+            if (level > 0) {
+              http.printf(" %d%s", level, s == DD_NOTRUMP ? "NT" : suit2sym(s));
+            }
+          }
+          http.printf("\n");
+        }
+      }
+      http.close();
+    });
+}
@@ -0,0 +1,52 @@
+// (c)2024, Arthur van Hoff, Artfahrt Inc.
+#pragma once
+#include "util.h"
+#include "deal.h"
+#include "solver.h"
+#include "boards.h"
+
+#define RECORDS_STACK       16384       // the solver recurses a frame per card
+#define RECORDS_PRIORITY    1           // below the idle loop
+
+enum RecordState {
+    RECORD_NONE,
+    RECORD_PENDING,
+    RECORD_SOLVING,
+    RECORD_DONE,
+    RECORD_FAILED,
+};
+
+struct Record {
+    uint8_t state = RECORD_NONE;
+    Bitboard bits;
+    DDTable table;
+    uint32_t ms = 0;                // time to solve
+    unsigned long nodes = 0;
+};
+
+//
+// Hand records, the double dummy tricks of the boards that were dealt.
+// A board is solved when asked for with /records?board=N. On the device boards are solved in a low priority task on the other
+// core, so the dealer is never held up; on the host solve() is
+// synchronous.
+//
+class HandRecords : public InitComponent {
+  public:
+    Record records[BOARDS_MAX];
+    std::mutex lock;                // records are shared with the task
+    DDSolver *solver = NULL;
+
+  public:
+    HandRecords() : InitComponent("Records") {}
+    virtual void init();
+
+    bool solve(int board, const Deal &deal);
+    void cancel();
+    void run();
+
+  private:
+    int next(Bitboard &bits);
+};
+
+extern HandRecords records;
+extern const char *record_state_name(int state);
@@ -1,11 +1,152 @@
 // (c)2024, Arthur van Hoff, Artfahrt Inc.
 #include "sensor.h"
+#include "webserver.h"
+#include "event.h"
 
+// single producer, the consumer is IRSensor::idle
 void IRSensor::handle_interrupt()
 {
   bool state = digitalRead(card.pin) == card.active_state;
   if (state != card.state) {
+    unsigned long us = micros();
     card.state = state;
     card.last_tm = millis();
+    card.last_us = us;
+    unsigned int h = card.head;
+    if (h - card.tail < IR_EDGES) {
+      card.edges[h % IR_EDGES].us = us;
+      card.edges[h % IR_EDGES].state = state;
+      card.head = h + 1;
+    } else {
+      card.overflows++;
+    }
+    events.post(state ? EV_CARD_DETECTED : EV_CARD_LEFT);
   }
-}
\ No newline at end of file
+}
+
+void IRSensor::init()
+{
+  attachInterrupt(digitalPinToInterrupt(pin), handle_interrupt, CHANGE);
+  WebServer::add("/sensor", [](HTTP &http) {
+    if (http.param["reset"] == "1") {
+      ::card.reset();
+    }
+    http.header(200, "Sensor Stats");
+    http.printf("Content-Type: text/plain\n");
+    http.body();
+    http.printf("%s: state=%d, cards=%lu, eject=%luus avg=%.0fus, load=%luus avg=%.0fus\n", ::card.name, ::card.state, ::card.cards, ::card.eject_us, ::card.eject_avg, ::card.load_us, ::card.load_avg);
+    http.printf("doubles=%lu, jams=%lu, glitches=%lu, missed=%lu, overflows=%lu\n", ::card.doubles, ::card.jams, ::card.glitches, ::card.missed, ::card.overflows);
+    http.close();
+  });
+}
+
+void IRSensor::drain()
+{
+  while (tail != head) {
+    IREdge e;
+    e.us = edges[tail % IR_EDGES].us;
+    e.state = edges[tail % IR_EDGES].state;
+    tail++;
+    edge(e.state, e.us);
+  }
+}
+
+void IRSensor::idle(unsigned long now)
+{
+  drain();
+  bool s = digitalRead(pin) == active_state;
+  if (s != state) {
+    dprintf("fixing sensor, state=%d", s);
+    missed++;
+    state = s;
+    last_tm = now;
+    last_us = micros();
+    edge(s, last_us);
+    events.post(s ? EV_CARD_DETECTED : EV_CARD_LEFT);
+  }
+  if (feed != IR_FEED_NONE && !jammed && micros() - feed_us > IR_JAM_US) {
+    jammed = true;
+    jams++;
+    dprintf("%s: jammed, no %s edge for %lums", name, feed == IR_FEED_EJECT ? "trailing" : "leading", (micros() - feed_us) / 1000);
+  }
+}
+
+// called by the ejector when it starts or stops the motors
+void IRSensor::feeding(int f)
+{
+  // edges before this belong to the previous feed
+  drain();
+  settling = false;
+  feed = f;
+  feed_us = micros();
+  jammed = false;
+}
+
+void IRSensor::edge(bool s, unsigned long us)
+{
+  if (s == present) {
+    return;
+  }
+  present = s;
+  if (settling) {
+    // the loaded card bounces on the sensor
+    settle_us = us - arrive_us;
+  }
+  if (s) {
+    // leading edge of a card
+    enter_us = us;
+    if (feed != IR_FEED_LOAD) {
+      return;
+    }
+    load_us = us - feed_us;
+    arrive_us = us;
+    settle_us = 0;
+    settling = true;
+    load_avg = load_avg == 0 ? load_us : load_avg * 0.9f + load_us * 0.1f;
+    if (leave_us != 0 && us - leave_us < IR_GAP_US) {
+      // the next card came along with the one that was ejected
+      double_feed = true;
+      doubles++;
+      dprintf("%s: double feed, gap=%luus", name, us - leave_us);
+    } else {
+      double_feed = false;
+    }
+    feed = IR_FEED_NONE;
+    return;
+  }
+  // trailing edge
+  if (us - enter_us < IR_GLITCH_US) {
+    glitches++;
+    return;
+  }
+  leave_us = us;
+  cards++;
+  if (feed != IR_FEED_EJECT) {
+    return;
+  }
+  eject_us = us - feed_us;
+  if (eject_avg > 0 && eject_us > eject_avg * IR_DOUBLE_RATIO) {
+    // two cards overlap on the sensor
+    double_feed = true;
+    doubles++;
+    dprintf("%s: double feed, eject=%luus, avg=%.0fus", name, eject_us, eject_avg);
+  } else {
+    eject_avg = eject_avg == 0 ? eject_us : eject_avg * 0.9f + eject_us * 0.1f;
+  }
+  // the ejector keeps the motors running to load the next card
+  feed = IR_FEED_LOAD;
+  feed_us = us;
+  jammed = false;
+}
+
+void IRSensor::reset()
+{
+  cards = 0;
+  doubles = 0;
+  jams = 0;
+  glitches = 0;
+  missed = 0;
+  overflows = 0;
+  eject_avg = 0;
+  load_avg = 0;
+}
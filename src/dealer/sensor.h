@@ -2,32 +2,80 @@
 #pragma once
 #include "util.h"
 
+#define IR_EDGES            64          // edge ring size, power of two
+#define IR_GLITCH_US        500         // pulses shorter than this are noise
+#define IR_GAP_US           5000        // a card this soon after the previous one left is a double feed
+#define IR_DOUBLE_RATIO     1.5f        // eject this much longer than average is a double feed
+#define IR_JAM_US           1000000     // feeding this long without the expected edge is a jam
+
+//
+// What the ejector is doing, a card rests on the sensor between loading
+// and ejecting so edges are only timed against the feed that causes them.
+// Ejecting ends on the trailing edge, loading starts there and ends on
+// the leading edge of the next card.
+//
+enum IRFeed {
+    IR_FEED_NONE,
+    IR_FEED_EJECT,
+    IR_FEED_LOAD,
+};
+
+struct IREdge {
+    unsigned long us;
+    bool state;
+};
+
 class IRSensor : public IdleComponent {
   public:
     int pin;
     bool state;
     int active_state;
     unsigned long last_tm;
+    unsigned long last_us;
+
+    // written by the interrupt handler, read by idle
+    volatile IREdge edges[IR_EDGES];
+    volatile unsigned int head = 0;
+    volatile unsigned int tail = 0;
+    unsigned long overflows = 0;
+
+    // derived from the edges
+    bool present = false;
+    unsigned long enter_us = 0;
+    unsigned long leave_us = 0;
+    int feed = IR_FEED_NONE;
+    unsigned long feed_us = 0;
+    unsigned long eject_us = 0;     // eject start to trailing edge, last card
+    float eject_avg = 0;            // us, moving average
+    unsigned long load_us = 0;      // load start to leading edge, last card
+    float load_avg = 0;             // us, moving average
+    unsigned long arrive_us = 0;    // leading edge of the last card loaded
+    unsigned long settle_us = 0;    // arrival to the last bounce, until the next feed
+    bool settling = false;
+    bool double_feed = false;       // last card
+    bool jammed = false;            // current feed
+    unsigned long cards = 0;
+    unsigned long doubles = 0;
+    unsigned long jams = 0;
+    unsigned long glitches = 0;
+    unsigned long missed = 0;
+
   public:
     IRSensor(const char *name, int pin, int active_state=LOW) : IdleComponent(name), pin(pin), active_state(active_state) {
     }
 
-    virtual void init() {
-      attachInterrupt(digitalPinToInterrupt(pin), handle_interrupt, CHANGE);
-    }
-    virtual void idle(unsigned long now) {
-      bool s = digitalRead(pin) == active_state;
-      if (s != state) {
-        dprintf("fixing sensor, state=%d", s);
-        state = s;
-        last_tm = now;
-      }
-    }
+    virtual void init();
+    virtual void idle(unsigned long now);
     virtual void halt() {
       detachInterrupt(digitalPinToInterrupt(pin));
     }
+    void reset();
+    void feeding(int f);
 
     static void handle_interrupt();
+  private:
+    void drain();
+    void edge(bool s, unsigned long us);
 };
 
-extern IRSensor card;
\ No newline at end of file
+extern IRSensor card;
@@ -0,0 +1,83 @@
+// (c)2024, Arthur van Hoff, Artfahrt Inc.
+#include "tracing.h"
+#include "webserver.h"
+
+extern BusMaster bus;
+
+static bool camera_traced()
+{
+    std::lock_guard<std::recursive_mutex> guard(bus.lock);
+    int addr = bus.lookup(BUS_ROLE_CAMERA);
+    return addr >= 0 && (bus.device(addr)->caps & BUS_CAP_TRACE) != 0;
+}
+
+static uint32_t unpack32(const unsigned char *buf)
+{
+    return buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t)buf[3] << 24);
+}
+
+// one CMD_TIME exchange, a sync is CLOCK_EXCHANGES of them
+void CameraTrace::idle(unsigned long now)
+{
+    if (!camera_traced()) {
+        schedule(TRACE_SYNC_INTERVAL);
+        return;
+    }
+    unsigned char res[4];
+    uint32_t t0 = micros();
+    if (!bus.request(BUS_ROLE_CAMERA, (const unsigned char []){CMD_TIME}, 1, res, sizeof(res))) {
+        failures++;
+        schedule(TRACE_SYNC_INTERVAL);
+        return;
+    }
+    uint32_t t1 = micros();
+    clock.exchange(t0, unpack32(res), t1);
+    schedule(clock.exchanges == 0 ? TRACE_SYNC_INTERVAL : TRACE_EXCHANGE_INTERVAL);
+}
+
+// all camera spans, in local time
+bool CameraTrace::fetch(std::vector<Span> &spans)
+{
+    if (!clock.synced() || !camera_traced()) {
+        return false;
+    }
+    unsigned char req[5] = {CMD_SPANS};
+    unsigned char res[TRACE_READ_LEN];
+    for (uint32_t seq = 0 ;;) {
+        req[1] = seq;
+        req[2] = seq >> 8;
+        req[3] = seq >> 16;
+        req[4] = seq >> 24;
+        if (!bus.request(BUS_ROLE_CAMERA, req, sizeof(req), res, sizeof(res))) {
+            return false;
+        }
+        int n = min((int)res[0], TRACE_READ_SPANS);
+        for (int i = 0 ; i < n ; i++) {
+            Span s;
+            memcpy(&s, res + 5 + i * sizeof(Span), sizeof(Span));
+            s.start = clock.to_local(s.start);
+            spans.push_back(s);
+        }
+        if (n < TRACE_READ_SPANS || spans.size() >= TRACE_SPANS) {
+            return true;
+        }
+        seq = unpack32(res + 1) + n;
+    }
+}
+
+void CameraTrace::init()
+{
+    tracer.remote = [](std::vector<Span> &spans) {
+      return ::camera_trace.fetch(spans);
+    };
+    tracer.remote_board = "camera";
+    WebServer::add("/clock", [](HTTP &http) {
+      ClockSync &c = ::camera_trace.clock;
+      http.header(200, "Clock Sync");
+      http.printf("Content-Type: text/plain\n");
+      http.body();
+      http.printf("camera: synced=%d, offset=%ldus, skew=%.1fppm, rtt=%luus, failures=%lu\n",
+        c.synced(), (long)c.offset, c.skew * 1e6f, (unsigned long)c.rtt, ::camera_trace.failures);
+      http.close();
+    });
+}
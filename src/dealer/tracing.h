@@ -0,0 +1,27 @@
+// (c)2024, Arthur van Hoff, Artfahrt Inc.
+#pragma once
+#include "util.h"
+#include "trace.h"
+#include "bus.h"
+
+#define TRACE_SYNC_INTERVAL     2000    // ms between clock syncs
+#define TRACE_EXCHANGE_INTERVAL 10      // ms between the exchanges of a sync
+
+//
+// Keeps the camera clock in sync with CMD_TIME, one exchange per
+// idle call, and fetches the camera spans for /trace in local time.
+//
+class CameraTrace : public IdleComponent {
+  public:
+    ClockSync clock;
+    unsigned long failures = 0;
+
+  public:
+    CameraTrace() : IdleComponent("CameraTrace", TRACE_SYNC_INTERVAL) {}
+    virtual void init();
+    virtual void idle(unsigned long now);
+
+    bool fetch(std::vector<Span> &spans);
+};
+
+extern CameraTrace camera_trace;